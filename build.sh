@@ -2,7 +2,7 @@
 
 mkdir -p bin
 
-g++ $@ -Wall -fno-exceptions -std=c++20 src/*.cpp -o bin/emulator.exe
+g++ $@ -Wall -fno-exceptions -pthread -std=c++20 src/*.cpp -o bin/emulator.exe
 
 rc=$?
 
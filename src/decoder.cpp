@@ -9,6 +9,24 @@
 #include <string>
 #include <unordered_map>
 #include <array>
+#include <charconv>
+#include <cstring>
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <atomic>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 using u8 = uint8_t;
 using u16 = uint16_t;
@@ -22,6 +40,8 @@ using i64 = int64_t;
 #define U8(x) static_cast<u8>(x)
 #define I8(x) static_cast<i8>(x)
 #define U16(x) static_cast<u16>(x)
+#define U32(x) static_cast<u32>(x)
+#define U64(x) static_cast<u64>(x)
 #define I16(x) static_cast<i16>(x)
 #define INT(x) static_cast<int>(x)
 #define SIZE(x) static_cast<size_t>(x)
@@ -208,15 +228,25 @@ std::string get_opcode_name(Operation operation) {
 }
 
 
-Operation match_opcode(u8 byte) {
+bool find_opcode(u8 byte, Operation& operation) {
   for (const Opcode& o : opcodes) {
     u8 shift = 8 - o.length;
     u8 mask = 0xFF << shift;
     u8 prefix = (byte & mask) >> shift;
     if (prefix == o.bits) {
-      return o.operation;
+      operation = o.operation;
+      return true;
     }
   }
+  return false;
+}
+
+
+Operation match_opcode(u8 byte) {
+  Operation operation {};
+  if (find_opcode(byte, operation)) {
+    return operation;
+  }
   std::cerr << std::format(
     "{}: Could not match instruction {} to opcode\n", __LINE__, (int)byte
   );
@@ -318,6 +348,194 @@ void read_binary_file(const std::string& filename, std::vector<u8> &program_buff
 }
 
 
+/* The 8086 has a 20-bit address bus, so the guest sees 1 MiB of memory. */
+constexpr size_t GUEST_MEMORY_SIZE = 0x100000;
+
+
+/*
+ * Guest physical memory. When a dump file is requested the memory is a shared
+ * mapping of that file, so every guest write already lands in the page cache
+ * and producing the dump at exit is just an unmap, never a copy.
+ */
+struct GuestMemory {
+  u8* data = nullptr;
+  size_t size = 0;
+  bool file_backed = false;
+};
+
+
+void allocate_guest_memory(GuestMemory& memory) {
+  memory.data = static_cast<u8*>(std::calloc(GUEST_MEMORY_SIZE, 1));
+  if (!memory.data) {
+    std::cerr << std::format("{}: Could not allocate guest memory\n", __LINE__);
+    std::exit(EXIT_FAILURE);
+  }
+  memory.size = GUEST_MEMORY_SIZE;
+  memory.file_backed = false;
+}
+
+
+void map_guest_memory(const std::string& filename, GuestMemory& memory) {
+#ifdef _WIN32
+  HANDLE file = CreateFileA(
+    filename.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+    CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr
+  );
+  if (file == INVALID_HANDLE_VALUE) {
+    std::cerr << std::format("{}: Could not create dump file: {}\n", __LINE__, filename);
+    std::exit(EXIT_FAILURE);
+  }
+  HANDLE mapping = CreateFileMappingA(
+    file, nullptr, PAGE_READWRITE, 0, static_cast<DWORD>(GUEST_MEMORY_SIZE), nullptr
+  );
+  CloseHandle(file);
+  if (!mapping) {
+    std::cerr << std::format("{}: Could not map dump file: {}\n", __LINE__, filename);
+    std::exit(EXIT_FAILURE);
+  }
+  void* view = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, GUEST_MEMORY_SIZE);
+  CloseHandle(mapping);
+  if (!view) {
+    std::cerr << std::format("{}: Could not map dump file: {}\n", __LINE__, filename);
+    std::exit(EXIT_FAILURE);
+  }
+#else
+  int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    std::cerr << std::format("{}: Could not create dump file: {}\n", __LINE__, filename);
+    std::exit(EXIT_FAILURE);
+  }
+  /* A freshly truncated file reads back as zeroes, like powered-on RAM, and
+   * stays sparse until the guest actually touches a page. */
+  if (ftruncate(fd, GUEST_MEMORY_SIZE) != 0) {
+    std::cerr << std::format("{}: Could not size dump file: {}\n", __LINE__, filename);
+    std::exit(EXIT_FAILURE);
+  }
+  void* view = mmap(nullptr, GUEST_MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (view == MAP_FAILED) {
+    std::cerr << std::format("{}: Could not map dump file: {}\n", __LINE__, filename);
+    std::exit(EXIT_FAILURE);
+  }
+#endif
+  memory.data = static_cast<u8*>(view);
+  memory.size = GUEST_MEMORY_SIZE;
+  memory.file_backed = true;
+}
+
+
+/* Unmapping hands dirty pages to the OS to write back; we never flush. */
+void release_guest_memory(GuestMemory& memory) {
+  if (memory.file_backed) {
+#ifdef _WIN32
+    UnmapViewOfFile(memory.data);
+#else
+    munmap(memory.data, memory.size);
+#endif
+  } else {
+    std::free(memory.data);
+  }
+  memory.data = nullptr;
+  memory.size = 0;
+}
+
+
+void load_program(const std::vector<u8>& program, GuestMemory& memory) {
+  if (program.size() > memory.size) {
+    std::cerr << std::format(
+      "{}: Program of {} bytes does not fit in guest memory\n", __LINE__, program.size()
+    );
+    std::exit(EXIT_FAILURE);
+  }
+  std::memcpy(memory.data, program.data(), program.size());
+}
+
+
+/*
+ * A framebuffer inside guest memory: width x height pixels of 4 bytes each
+ * (R, G, B, A), starting at a physical offset. This is the layout the
+ * computer_enhance drawing listings write.
+ */
+struct ImageRegion {
+  u32 width = 0;
+  u32 height = 0;
+  u32 offset = 0;
+};
+
+
+constexpr size_t IMAGE_BYTES_PER_PIXEL = 4;
+
+
+bool parse_u32(std::string_view text, u32& value) {
+  int base = 10;
+  if (text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) {
+    text.remove_prefix(2);
+    base = 16;
+  }
+  auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value, base);
+  return error == std::errc() && end == text.data() + text.size() && !text.empty();
+}
+
+
+/* Parses an image specification of the form WxH@offset, e.g. 64x64@256. */
+bool parse_image_region(std::string_view spec, ImageRegion& region) {
+  size_t x = spec.find('x');
+  size_t at = spec.find('@');
+  if (x == std::string_view::npos || at == std::string_view::npos || at < x) {
+    return false;
+  }
+  return parse_u32(spec.substr(0, x), region.width)
+      && parse_u32(spec.substr(x + 1, at - x - 1), region.height)
+      && parse_u32(spec.substr(at + 1), region.offset);
+}
+
+
+/*
+ * Writes a framebuffer region of guest memory to disk. A ".ppm" extension
+ * produces a binary PPM (alpha dropped); anything else gets the raw RGBA
+ * bytes exactly as they sit in guest memory.
+ */
+void write_image(const std::string& filename, const ImageRegion& region, const GuestMemory& memory) {
+  /* Each dimension is checked against the space left before multiplying, so
+   * huge sizes cannot wrap the length back into range. */
+  size_t available = region.offset < memory.size ? memory.size - region.offset : 0;
+  if (region.width == 0 || region.height == 0) {
+    std::cerr << std::format(
+      "{}: Image {}x{}@{} has no pixels\n", __LINE__, region.width, region.height, region.offset
+    );
+    std::exit(EXIT_FAILURE);
+  }
+  if (region.width > available / IMAGE_BYTES_PER_PIXEL
+      || region.height > available / (SIZE(region.width) * IMAGE_BYTES_PER_PIXEL)) {
+    std::cerr << std::format(
+      "{}: Image {}x{}@{} extends past the end of guest memory\n",
+      __LINE__, region.width, region.height, region.offset
+    );
+    std::exit(EXIT_FAILURE);
+  }
+  size_t length = SIZE(region.width) * region.height * IMAGE_BYTES_PER_PIXEL;
+  std::ofstream file(filename, std::ios::binary);
+  if (!file) {
+    std::cerr << std::format("{}: Could not open image file: {}\n", __LINE__, filename);
+    std::exit(EXIT_FAILURE);
+  }
+  const u8* pixels = memory.data + region.offset;
+  if (std::filesystem::path(filename).extension() == ".ppm") {
+    file << std::format("P6\n{} {}\n255\n", region.width, region.height);
+    std::vector<u8> row(SIZE(region.width) * 3);
+    for (u32 y = 0; y < region.height; y++) {
+      for (u32 x = 0; x < region.width; x++) {
+        std::memcpy(&row[x * 3], pixels + x * IMAGE_BYTES_PER_PIXEL, 3);
+      }
+      file.write(reinterpret_cast<const char*>(row.data()), row.size());
+      pixels += SIZE(region.width) * IMAGE_BYTES_PER_PIXEL;
+    }
+  } else {
+    file.write(reinterpret_cast<const char*>(pixels), length);
+  }
+}
+
+
 /* Table 4-08. MOD (Mode) Field Encoding of the 8086 manual. */
 u8 num_displacement_bytes(u8 mod, u8 rm) {
 	switch (mod) {
@@ -337,7 +555,7 @@ u8 num_displacement_bytes(u8 mod, u8 rm) {
 
 
 /* Determines the byte-length of an instruction encoding. */
-u8 instruction_size(Operation op, std::vector<u8> &program, u8 index) {
+u8 instruction_size(Operation op, std::vector<u8> &program, size_t index) {
 
   switch (op) {
     case Operation::JMP_EQUAL:
@@ -412,6 +630,52 @@ u8 instruction_size(Operation op, std::vector<u8> &program, u8 index) {
 }
 
 
+/*
+ * Matches the opcode at cursor and returns the size of its encoding, after
+ * checking every byte instruction_size() and get_mnemonic() will look at is
+ * there and understood. Bad input is described in error and 0 is returned,
+ * so callers choose whether to exit or carry on.
+ */
+size_t checked_instruction_size(std::vector<u8>& program, size_t cursor, Operation& operation, std::string& error) {
+  if (!find_opcode(program[cursor], operation)) {
+    error = std::format("Could not match instruction {} at {} to opcode", program[cursor], cursor);
+    return 0;
+  }
+  /* Every instruction is at least two bytes, and instruction_size() may
+   * read the second. */
+  if (cursor + 2 > program.size()) {
+    error = std::format("Truncated instruction at {}", cursor);
+    return 0;
+  }
+  if (operation == Operation::ASC_IMM_TO_REGMEM) {
+    u8 identifier = (program[cursor + 1] & 0b111000) >> 3;
+    if (identifier != 0b000 && identifier != 0b101 && identifier != 0b111) {
+      error = std::format("Unsupported immediate operation {:03b} at {}", identifier, cursor);
+      return 0;
+    }
+  }
+  size_t size = instruction_size(operation, program, cursor);
+  if (cursor + size > program.size()) {
+    error = std::format("Truncated instruction at {}", cursor);
+    return 0;
+  }
+  return size;
+}
+
+
+/*
+ * Formats a memory operand with a signed displacement, e.g. [bp - 4]. A zero
+ * displacement is left out, as it only exists because [bp] has no mod 00
+ * encoding.
+ */
+std::string format_displaced(const std::string& base, i16 disp) {
+  if (disp == 0) {
+    return std::format("[{}]", base);
+  }
+  return std::format("[{} {} {}]", base, (disp < 0 ? '-' : '+'), std::abs(disp));
+}
+
+
 std::string disassemble_regmem_to_from_reg(std::string name, std::vector<u8>& instruction) {
   using iterator = std::unordered_map<u8, std::string>::const_iterator;
 
@@ -423,96 +687,44 @@ std::string disassemble_regmem_to_from_reg(std::string name, std::vector<u8>& in
   u8 reg = (low & 0b00111000) >> 3;
   u8 rm = low & 0b00000111;
 
-  auto register_names = get_register_name_map();
-  auto rm_values = get_rm_map();
+  const auto& register_names = get_register_name_map();
+  const auto& rm_values = get_rm_map();
 
-  /* Effective address calculation w/ 16-bit displacement */
-  if (mod == 0b10) {
-    u8 disp_high = U8(instruction[3]);
-    u8 disp_low = U8(instruction[2]);
-    i16 disp = I16((disp_high << 8) + disp_low);
-    u8 key_reg = reg + (wide << 3);
-    iterator reg_it = register_names.find(key_reg);
-    iterator rm_it = rm_values.find(rm);
-    if (direction) {
-      return std::format(
-        "{} {}, [{} {:+}]\n",
-        name, (*reg_it).second, (*rm_it).second, disp);
-    } else {
-      return std::format(
-        "{} [{} {:+}], {}\n",
-        name, (*rm_it).second, disp, (*reg_it).second);
-    }
+  u8 key_reg = reg + (wide << 3);
+  iterator reg_it = register_names.find(key_reg);
+  if (reg_it == register_names.end()) {
+    std::cerr << std::format("{}: Bad register encoding\n", __LINE__);
+    std::exit(EXIT_FAILURE);
+  }
 
+  std::string regmem {};
+  if (mod == 0b10) {
+    /* Effective address calculation w/ 16-bit displacement */
+    i16 disp = I16((instruction[3] << 8) + instruction[2]);
+    regmem = format_displaced(rm_values.find(rm)->second, disp);
   } else if (mod == 0b01) {
     /* Effective address calculation w/ 8-bit displacement */
     i8 disp = I8(instruction[2]);
-    u8 key_reg = reg + (wide << 3);
-    iterator reg_it = register_names.find(key_reg);
-    iterator rm_it = rm_values.find(rm);
-    if (direction) {
-      return std::format(
-        "{} {}, [{} {:+}]\n",
-        name, (*reg_it).second, (*rm_it).second, disp);
-    } else {
-      return std::format(
-        "{} [{} + {}], {}\n",
-        name, (*rm_it).second, (int)disp, (*reg_it).second);
-    }
+    regmem = format_displaced(rm_values.find(rm)->second, disp);
+  } else if (mod == 0b00 && rm == 0b110) {
+    /* Direct address: 16-bit displacement follows */
+    u16 addr = U16((instruction[3] << 8) + instruction[2]);
+    regmem = std::format("[{}]", addr);
   } else if (mod == 0b00) {
-    if (rm == 0b110) {
-      /* Direct address: 16-bit displacement follows */
-      u8 key_reg = reg + (wide << 3);
-      u8 disp_high = U8(instruction[3]);
-      u8 disp_low = U8(instruction[2]);
-      i16 disp = I16((disp_high << 8) + disp_low);
-      iterator reg_it = register_names.find(key_reg);
-      if (direction) {
-        return std::format("{} {}, [{}{}]\n", name, (*reg_it).second, (disp < 0 ? "-" : ""), std::abs(disp));
-      } else {
-        return std::format("{} [{}{}], {}\n", name, (disp < 0 ? "-" : ""), std::abs(disp), (*reg_it).second);
-      }
-    } else {
-      /* No displacement */
-      u8 key_reg  = reg + (wide << 3);
-      iterator reg_it = register_names.find(key_reg);
-      iterator rm_it = rm_values.find(rm);
-      if (reg_it == register_names.end() || rm_it == rm_values.end()) {
-        std::cerr << std::format("{}: Bad register encoding\n", __LINE__);
-        std::exit(EXIT_FAILURE);
-      }
-      if (direction) {
-        return std::format(
-          "{} {}, [{}]\n",
-          name, (*reg_it).second, (*rm_it).second);
-      } else {
-        return std::format(
-          "{} [{}], {}\n",
-          name, (*rm_it).second, (*reg_it).second);
-      }
-    }
-  } else if (mod == 0b11) {
+    /* No displacement */
+    regmem = std::format("[{}]", rm_values.find(rm)->second);
+  } else {
     /* Register to Register */
     u8 key_rm = rm + (wide << 3);
-    u8 key_reg  = reg + (wide << 3);
-    iterator source_it {};
-    iterator destination_it {};
-    if (direction) {
-      source_it = register_names.find(key_rm);
-      destination_it = register_names.find(key_reg);
-    } else {
-      destination_it = register_names.find(key_reg);
-      source_it = register_names.find(key_rm);
-    }
-    if (source_it == register_names.end() || destination_it == register_names.end()) {
-      std::cerr << std::format("{}: Bad register encoding\n", __LINE__);
-      std::exit(EXIT_FAILURE);
-    }
-    return std::format(
-      "{} {}, {}\n", name, (*source_it).second, (*destination_it).second
-    );
+    regmem = register_names.find(key_rm)->second;
+  }
+
+  /* The D bit set means REG is the destination. */
+  if (direction) {
+    return std::format("{} {}, {}\n", name, reg_it->second, regmem);
+  } else {
+    return std::format("{} {}, {}\n", name, regmem, reg_it->second);
   }
-  return std::format("Unknown: regmem_to_from_reg, mod = {}, rm = {}\n", mod, rm);
 }
 
 
@@ -533,70 +745,37 @@ std::string disassemble_imm_to_regmem(std::string name, std::vector<u8>& instruc
     sign_extend = false;
   }
 
+  /* The immediate follows the displacement, if any. A wide immediate with
+   * the S bit set is a single byte, sign-extended to 16 bits. */
+  size_t data_index = 2 + num_displacement_bytes(mod, rm);
+  i16 data {};
+  if (wide && !sign_extend) {
+    data = I16((instruction[data_index + 1] << 8) + instruction[data_index]);
+  } else {
+    data = I8(instruction[data_index]);
+  }
+
   switch(mod) {
 
     case 0b00: {
-      i16 data {};
       if (rm == 0b110) {
         /* Memory mode, 16-bit displacement follows */
-        i16 disp = I16(instruction[3] << 8) + instruction[2];
-        if (wide) {
-          if (sign_extend) { 
-            data = I16(instruction[4]);
-          } else {
-            data = I16(instruction[5] << 8) + instruction[4];
-          }
-        } else {
-          data = I16(instruction[4]);
-        }
-			  return std::format("{} {} [{}], {}\n", name, length, disp, data);
+        u16 addr = U16((instruction[3] << 8) + instruction[2]);
+        return std::format("{} {} [{}], {}\n", name, length, addr, data);
       } else {
         /* Memory mode, no displacement */
-        if (wide) {
-          if (sign_extend) { 
-            data = I16(instruction[2]);
-          } else {
-            data = I16(instruction[3] << 8) + instruction[2];
-          }
-        } else {
-          data = I16(instruction[2]);
-        }
-			  return std::format("{} {} [{}], {}\n", name, length, rm_it->second, data);
+        return std::format("{} {} [{}], {}\n", name, length, rm_it->second, data);
       }
     }
 
     case 0b01: {
       i8 disp = I8(instruction[2]);
-      i16 data {};
-      if (wide) {
-        if (sign_extend) { 
-          data = I16(instruction[3]);
-        } else {
-          data = I16(instruction[4] << 8) + instruction[3];
-        }
-      } else {
-        data = I16(instruction[3]);
-      }
-			return std::format("{} {} [{} {} {}], {}\n",
-				name, length, rm_it->second, (disp < 0 ? "-" : "+"), disp, data);
+      return std::format("{} {} {}, {}\n", name, length, format_displaced(rm_it->second, disp), data);
     }
 
     case 0b10: {
       i16 disp = I16((instruction[3] << 8) + instruction[2]);
-      i16 data {};
-      if (wide) {
-        if (sign_extend) { 
-          data = I16(instruction[4]);
-        } else {
-          /* 16-bit extension */
-          data = I16(instruction[5] << 8) + instruction[4];
-        }
-      } else {
-        /* 8-bit extension */
-        data = I16(instruction[4]);
-      }
-    	return std::format("{} {} [{} {} {}], {}\n",
-				name, length, rm_it->second, (disp < 0 ? "-" : "+"), disp, data);
+      return std::format("{} {} {}, {}\n", name, length, format_displaced(rm_it->second, disp), data);
     }
 
     case 0b11: {
@@ -607,18 +786,7 @@ std::string disassemble_imm_to_regmem(std::string name, std::vector<u8>& instruc
         std::cerr << std::format("{}: Register encoding not found\n", __LINE__);
         std::exit(EXIT_FAILURE);
       }
-      i16 data {};
-      if (wide) {
-        if (sign_extend) { 
-          data = I16(instruction[2]);
-        } else {
-				  data = I16(instruction[2] << 8) + instruction[1];
-        }
-      } else {
-        data = I16(instruction[2]);
-      }
-      std::string op_name = map_generic_to_name(Operation::ASC_IMM_TO_REGMEM , instruction);
-      return std::format("{} {}, {}\n", op_name, dest->second, data);
+      return std::format("{} {}, {}\n", name, dest->second, data);
     }
 
   };
@@ -647,27 +815,18 @@ std::string disassemble_imm_to_reg(std::string name, std::vector<u8>& instructio
 }
 
 
+/* The address is always 16 bits; W only selects al or ax. */
 std::string disassemble_mem_to_acc(std::string name, std::vector<u8>& instruction) {
   bool wide = instruction[0] & 0b01;
-  if (wide) {
-    u16 addr = U16((instruction[2] << 8) + instruction[1]);
-    return std::format("{} ax, [{}]\n", name, addr);
-  } else {
-    u8 addr = U8(instruction[1]);
-    return std::format("{} al, [{}]\n", name, addr);
-  }
+  u16 addr = U16((instruction[2] << 8) + instruction[1]);
+  return std::format("{} {}, [{}]\n", name, wide ? "ax" : "al", addr);
 }
 
 
 std::string disassemble_acc_to_mem(std::string name, std::vector<u8>& instruction) {
   bool wide = instruction[0] & 0b01;
-  if (wide) {
-    u16 addr = U16((instruction[2] << 8) + instruction[1]);
-    return std::format("{} [{}], ax\n", name, addr);
-  } else {
-    u8 addr = U8(instruction[1]);
-    return std::format("{} [{}], al\n", name, addr);
-  }
+  u16 addr = U16((instruction[2] << 8) + instruction[1]);
+  return std::format("{} [{}], {}\n", name, addr, wide ? "ax" : "al");
 }
 
 
@@ -741,42 +900,2292 @@ std::string disassemble(std::string name, Operation op, std::vector<u8> &instruc
 }
 
 
-int main(int argc, char **argv) {
-  if (argc < 2) {
-    std::cerr << std::format(
-      "{}: Must specify program file as first positional argument\n", __LINE__
-    );
-    return EXIT_FAILURE;
+/*
+ * Disassembles the instruction at program_cursor, returning its size. Input
+ * the decoder cannot handle is described in error and 0 is returned, so
+ * callers that must survive bad input (--watch) never reach an exit path.
+ */
+size_t try_disassemble_at(std::vector<u8>& program_data, size_t program_cursor, std::string& text, std::string& error) {
+  std::vector<u8> instruction {};
+
+  Operation operation {};
+  size_t size = checked_instruction_size(program_data, program_cursor, operation, error);
+  if (!size) {
+    return 0;
   }
+  std::string name = get_opcode_name(operation);
 
-  char* program_filename = argv[1];
-  if (!std::filesystem::exists(program_filename)) {
-    std::cerr << std::format(
-    "{}: Could not find program file: {}\n", __LINE__, program_filename
-  );
-    return EXIT_FAILURE;
+  for (size_t i = 0; i < size; i++) {
+    instruction.push_back(program_data[program_cursor + i]);
   }
 
-  std::ifstream program_file(program_filename);
-  std::vector<u8> program_data {};
-  read_binary_file(program_filename, program_data);
+  text = disassemble(name, operation, instruction);
+  return size;
+}
+
+
+size_t disassemble_at(std::vector<u8>& program_data, size_t program_cursor, std::string& text) {
+  std::string error {};
+  size_t size = try_disassemble_at(program_data, program_cursor, text, error);
+  if (!size) {
+    std::cerr << std::format("{}: {}\n", __LINE__, error);
+    std::exit(EXIT_FAILURE);
+  }
+  return size;
+}
+
+
+/* Streams the listing line by line, so everything decoded before a bad
+ * instruction is still printed. */
+void print_disassembly(std::vector<u8>& program_data) {
+  std::string text {};
+  size_t program_cursor = 0;
+  while (program_cursor < program_data.size()) {
+    program_cursor += disassemble_at(program_data, program_cursor, text);
+    std::cout << text;
+  }
+}
 
-  u16 program_cursor = 0;
+
+/* Builds the whole listing, for storing in the decode cache. */
+std::string disassemble_program(std::vector<u8>& program_data) {
+  std::string listing {};
+  std::string text {};
+  size_t program_cursor = 0;
   while (program_cursor < program_data.size()) {
-    std::vector<u8> instruction {};
+    program_cursor += disassemble_at(program_data, program_cursor, text);
+    listing += text;
+  }
+  return listing;
+}
+
+
+/*
+ * What an instruction does, independent of how it was encoded. The generic
+ * ASC_IMM_TO_REGMEM operation only learns its mnemonic from the REG field of
+ * the second byte, so it is resolved here once rather than at every use.
+ */
+enum class Mnemonic : u8 {
+  MOV,
+  ADD,
+  SUB,
+  CMP,
+  JUMP
+};
 
-    Operation operation = match_opcode(program_data[program_cursor]);
-    std::string name = get_opcode_name(operation);
 
-    unsigned int size = instruction_size(operation, program_data, program_cursor);
+enum class OperandKind : u8 {
+  NONE,
+  REGISTER,
+  MEMORY,
+  IMMEDIATE
+};
+
+
+/*
+ * A decoded operand. Registers use the REG encoding with the W bit at bit 3
+ * (see REGISTER_ENCODING), memory operands keep the R/M field (see
+ * RM_ENCODING) plus displacement, and direct addresses keep R/M 110 and
+ * store the address in the displacement. displacement_bytes is how many
+ * bytes the displacement was encoded in, since [bx + 0] may use mod 01 and
+ * costs more than [bx]. Jump targets are IMMEDIATE operands holding the
+ * signed IP increment.
+ */
+struct Operand {
+  OperandKind kind = OperandKind::NONE;
+  u8 reg = 0;
+  u8 rm = 0;
+  bool direct = false;
+  u8 displacement_bytes = 0;
+  i16 displacement = 0;
+  i16 immediate = 0;
+
+  bool operator==(const Operand&) const = default;
+};
+
+
+/* A structured decode of one instruction, as consumed by the interpreter. */
+struct Instruction {
+  Operation operation = Operation::COUNT;
+  Mnemonic mnemonic = Mnemonic::MOV;
+  bool wide = false;
+  u8 size = 0;
+  u16 address = 0;
+  Operand destination {};
+  Operand source {};
+
+  bool operator==(const Instruction&) const = default;
+};
+
+
+Mnemonic get_mnemonic(Operation op, std::vector<u8>& instruction) {
+  switch (op) {
+    case Operation::REGMEM_TO_FROM_REG:
+    case Operation::IMM_TO_REGMEM:
+    case Operation::IMM_TO_REG:
+    case Operation::MEM_TO_ACC:
+    case Operation::ACC_TO_MEM:
+      return Mnemonic::MOV;
+    case Operation::ADD_REGMEM_WITH_REG:
+    case Operation::ADD_IMM_TO_ACC:
+      return Mnemonic::ADD;
+    case Operation::SUB_REGMEM_WITH_REG:
+    case Operation::SUB_IMM_FROM_ACC:
+      return Mnemonic::SUB;
+    case Operation::CMP_REGMEM_AND_REG:
+    case Operation::CMP_IMM_WITH_ACC:
+      return Mnemonic::CMP;
+    case Operation::ASC_IMM_TO_REGMEM:
+      switch ((instruction[1] & 0b111000) >> 3) {
+        case 0b000: return Mnemonic::ADD;
+        case 0b101: return Mnemonic::SUB;
+        case 0b111: return Mnemonic::CMP;
+        default:
+          std::cerr << std::format("{}: could find find op name\n", __LINE__);
+          std::exit(EXIT_FAILURE);
+      }
+    default:
+      return Mnemonic::JUMP;
+  }
+}
+
+
+/* Decodes the MOD and R/M fields of the second byte into an operand. */
+Operand decode_regmem_operand(std::vector<u8>& instruction, bool wide) {
+  u8 mod = (instruction[1] & 0b11000000) >> 6;
+  u8 rm = instruction[1] & 0b111;
+  Operand operand {};
+  if (mod == 0b11) {
+    operand.kind = OperandKind::REGISTER;
+    operand.reg = rm + (wide << 3);
+    return operand;
+  }
+  operand.kind = OperandKind::MEMORY;
+  operand.rm = rm;
+  operand.displacement_bytes = num_displacement_bytes(mod, rm);
+  if (mod == 0b00 && rm == 0b110) {
+    operand.direct = true;
+    operand.displacement = I16(instruction[2] | (instruction[3] << 8));
+  } else if (mod == 0b01) {
+    operand.displacement = I8(instruction[2]);
+  } else if (mod == 0b10) {
+    operand.displacement = I16(instruction[2] | (instruction[3] << 8));
+  }
+  return operand;
+}
+
+
+Operand register_operand(u8 reg) {
+  Operand operand {};
+  operand.kind = OperandKind::REGISTER;
+  operand.reg = reg;
+  return operand;
+}
+
+
+Operand immediate_operand(i16 value) {
+  Operand operand {};
+  operand.kind = OperandKind::IMMEDIATE;
+  operand.immediate = value;
+  return operand;
+}
+
+
+/* Reads an 8 or 16-bit immediate starting at instruction[index]. */
+i16 read_immediate(std::vector<u8>& instruction, size_t index, bool wide, bool sign_extend) {
+  if (wide && !sign_extend) {
+    return I16(instruction[index] | (instruction[index + 1] << 8));
+  }
+  return I8(instruction[index]);
+}
+
 
-    for (unsigned int i = 0; i < size; i++) {
-      instruction.push_back(program_data[program_cursor + i]);
+Instruction decode_instruction(Operation op, std::vector<u8>& instruction, u16 address) {
+  Instruction decoded {};
+  decoded.operation = op;
+  decoded.mnemonic = get_mnemonic(op, instruction);
+  decoded.size = U8(instruction.size());
+  decoded.address = address;
+
+  switch (op) {
+    case Operation::REGMEM_TO_FROM_REG:
+    case Operation::ADD_REGMEM_WITH_REG:
+    case Operation::SUB_REGMEM_WITH_REG:
+    case Operation::CMP_REGMEM_AND_REG: {
+      decoded.wide = instruction[0] & 0b01;
+      bool direction = (instruction[0] & 0b10) >> 1;
+      Operand reg = register_operand(((instruction[1] & 0b111000) >> 3) + (decoded.wide << 3));
+      Operand regmem = decode_regmem_operand(instruction, decoded.wide);
+      decoded.destination = direction ? reg : regmem;
+      decoded.source = direction ? regmem : reg;
+      break;
+    }
+    case Operation::IMM_TO_REGMEM:
+    case Operation::ASC_IMM_TO_REGMEM: {
+      decoded.wide = instruction[0] & 0b01;
+      /* Only the ASC form has an S bit; for mov the bit is part of the opcode. */
+      bool sign_extend = op == Operation::ASC_IMM_TO_REGMEM && (instruction[0] & 0b10);
+      u8 mod = (instruction[1] & 0b11000000) >> 6;
+      u8 rm = instruction[1] & 0b111;
+      decoded.destination = decode_regmem_operand(instruction, decoded.wide);
+      decoded.source = immediate_operand(read_immediate(
+        instruction, 2 + num_displacement_bytes(mod, rm), decoded.wide, sign_extend
+      ));
+      break;
+    }
+    case Operation::IMM_TO_REG:
+      decoded.wide = (instruction[0] & 0b1000) >> 3;
+      decoded.destination = register_operand((instruction[0] & 0b111) + (decoded.wide << 3));
+      decoded.source = immediate_operand(read_immediate(instruction, 1, decoded.wide, false));
+      break;
+    case Operation::MEM_TO_ACC:
+    case Operation::ACC_TO_MEM: {
+      decoded.wide = instruction[0] & 0b01;
+      Operand memory {};
+      memory.kind = OperandKind::MEMORY;
+      memory.rm = 0b110;
+      memory.direct = true;
+      memory.displacement_bytes = 2;
+      memory.displacement = I16(instruction[1] | (instruction[2] << 8));
+      Operand accumulator = register_operand(decoded.wide << 3);
+      decoded.destination = op == Operation::MEM_TO_ACC ? accumulator : memory;
+      decoded.source = op == Operation::MEM_TO_ACC ? memory : accumulator;
+      break;
     }
-    program_cursor += size;
+    case Operation::ADD_IMM_TO_ACC:
+    case Operation::SUB_IMM_FROM_ACC:
+    case Operation::CMP_IMM_WITH_ACC:
+      decoded.wide = instruction[0] & 0b01;
+      decoded.destination = register_operand(decoded.wide << 3);
+      decoded.source = immediate_operand(read_immediate(instruction, 1, decoded.wide, false));
+      break;
+    default:
+      /* Every remaining operation is a short jump with an 8-bit IP increment. */
+      decoded.source = immediate_operand(I8(instruction[1]));
+      break;
+  }
+  return decoded;
+}
+
+
+/* Decodes an entire program image into its instruction stream. */
+std::vector<Instruction> decode_program(std::vector<u8>& program) {
+  std::vector<Instruction> instructions {};
+  size_t cursor = 0;
+  while (cursor < program.size()) {
+    Operation operation {};
+    std::string error {};
+    size_t size = checked_instruction_size(program, cursor, operation, error);
+    if (!size) {
+      std::cerr << std::format("{}: {}\n", __LINE__, error);
+      std::exit(EXIT_FAILURE);
+    }
+    std::vector<u8> instruction(program.begin() + cursor, program.begin() + cursor + size);
+    instructions.push_back(decode_instruction(operation, instruction, U16(cursor)));
+    cursor += size;
+  }
+  return instructions;
+}
+
+
+/* Flag register bit positions, see "Status register flags" in the README. */
+constexpr u16 FLAG_CARRY = 1 << 0;
+constexpr u16 FLAG_PARITY = 1 << 2;
+constexpr u16 FLAG_AUXILIARY = 1 << 4;
+constexpr u16 FLAG_ZERO = 1 << 6;
+constexpr u16 FLAG_SIGN = 1 << 7;
+constexpr u16 FLAG_OVERFLOW = 1 << 11;
+
+
+/*
+ * The flags are kept lazily: arithmetic only records its operands and result,
+ * and the flags word is computed from them when something actually reads it.
+ * MOV here means no arithmetic has run yet, so every flag is clear.
+ */
+struct LazyFlags {
+  Mnemonic mnemonic = Mnemonic::MOV;
+  bool wide = false;
+  u16 a = 0;
+  u16 b = 0;
+  u16 result = 0;
+};
+
+
+/* PF is set when the low byte of the result has an even number of 1 bits. */
+bool even_parity(u16 value) {
+  u8 nibble = (value ^ (value >> 4)) & 0xF;
+  return !((0x6996 >> nibble) & 1);
+}
+
+
+u16 materialize_flags(const LazyFlags& lazy) {
+  if (lazy.mnemonic == Mnemonic::MOV) {
+    return 0;
+  }
+  u16 sign = lazy.wide ? 0x8000 : 0x80;
+  u16 a = lazy.a;
+  u16 b = lazy.b;
+  u16 r = lazy.result;
+  u16 flags = 0;
+  if (lazy.mnemonic == Mnemonic::ADD) {
+    u32 mask = lazy.wide ? 0xFFFF : 0xFF;
+    if (u32(a) + u32(b) > mask) flags |= FLAG_CARRY;
+    if (~(a ^ b) & (a ^ r) & sign) flags |= FLAG_OVERFLOW;
+  } else {
+    if (a < b) flags |= FLAG_CARRY;
+    if ((a ^ b) & (a ^ r) & sign) flags |= FLAG_OVERFLOW;
+  }
+  if ((a ^ b ^ r) & 0x10) flags |= FLAG_AUXILIARY;
+  if (r == 0) flags |= FLAG_ZERO;
+  if (r & sign) flags |= FLAG_SIGN;
+  if (even_parity(r)) flags |= FLAG_PARITY;
+  return flags;
+}
+
+
+/* Registers in REG field order: ax, cx, dx, bx, sp, bp, si, di. */
+struct Cpu {
+  std::array<u16, 8> registers {};
+  u16 ip = 0;
+  LazyFlags flags {};
+};
+
+
+u16 read_register(const Cpu& cpu, u8 reg) {
+  if (reg & 0b1000) {
+    return cpu.registers[reg & 0b111];
+  }
+  u16 value = cpu.registers[reg & 0b11];
+  return (reg & 0b100) ? value >> 8 : value & 0xFF;
+}
+
+
+void write_register(Cpu& cpu, u8 reg, u16 value) {
+  if (reg & 0b1000) {
+    cpu.registers[reg & 0b111] = value;
+  } else if (reg & 0b100) {
+    u16& full = cpu.registers[reg & 0b11];
+    full = U16((full & 0x00FF) | ((value & 0xFF) << 8));
+  } else {
+    u16& full = cpu.registers[reg & 0b11];
+    full = U16((full & 0xFF00) | (value & 0xFF));
+  }
+}
+
+
+/* Table 4-10. R/M (Register/Memory) Field Encoding, as a physical offset. */
+u16 effective_address(const Cpu& cpu, const Operand& operand) {
+  if (operand.direct) {
+    return U16(operand.displacement);
+  }
+  constexpr u8 BX = 3, BP = 5, SI = 6, DI = 7;
+  const std::array<u16, 8>& r = cpu.registers;
+  u16 base = 0;
+  switch (operand.rm) {
+    case 0b000: base = r[BX] + r[SI]; break;
+    case 0b001: base = r[BX] + r[DI]; break;
+    case 0b010: base = r[BP] + r[SI]; break;
+    case 0b011: base = r[BP] + r[DI]; break;
+    case 0b100: base = r[SI]; break;
+    case 0b101: base = r[DI]; break;
+    case 0b110: base = r[BP]; break;
+    case 0b111: base = r[BX]; break;
+  }
+  return U16(base + operand.displacement);
+}
+
+
+u16 read_operand(const Cpu& cpu, const GuestMemory& memory, const Operand& operand, bool wide) {
+  switch (operand.kind) {
+    case OperandKind::REGISTER:
+      return read_register(cpu, operand.reg);
+    case OperandKind::MEMORY: {
+      u16 address = effective_address(cpu, operand);
+      u16 value = memory.data[address];
+      if (wide) {
+        value |= memory.data[SIZE(address) + 1] << 8;
+      }
+      return value;
+    }
+    case OperandKind::IMMEDIATE:
+      return wide ? U16(operand.immediate) : U16(operand.immediate & 0xFF);
+    default:
+      std::cerr << std::format("{}: Read from empty operand\n", __LINE__);
+      std::exit(EXIT_FAILURE);
+  }
+}
+
+
+void write_operand(Cpu& cpu, GuestMemory& memory, const Operand& operand, bool wide, u16 value) {
+  if (operand.kind == OperandKind::REGISTER) {
+    write_register(cpu, operand.reg, value);
+  } else if (operand.kind == OperandKind::MEMORY) {
+    u16 address = effective_address(cpu, operand);
+    memory.data[address] = U8(value);
+    if (wide) {
+      memory.data[SIZE(address) + 1] = U8(value >> 8);
+    }
+  } else {
+    std::cerr << std::format("{}: Write to non-writable operand\n", __LINE__);
+    std::exit(EXIT_FAILURE);
+  }
+}
+
+
+/* Evaluates a conditional jump against a materialized flags word. */
+bool condition_holds(Operation op, u16 flags) {
+  bool cf = flags & FLAG_CARRY;
+  bool pf = flags & FLAG_PARITY;
+  bool zf = flags & FLAG_ZERO;
+  bool sf = flags & FLAG_SIGN;
+  bool of = flags & FLAG_OVERFLOW;
+  switch (op) {
+    case Operation::JMP_EQUAL: return zf;
+    case Operation::JMP_LESS: return sf != of;
+    case Operation::JMP_LESS_OR_EQUAL: return zf || sf != of;
+    case Operation::JMP_BELOW: return cf;
+    case Operation::JMP_BELOW_OR_EQUAL: return cf || zf;
+    case Operation::JMP_PARITY: return pf;
+    case Operation::JMP_OVERFLOW: return of;
+    case Operation::JMP_SIGN: return sf;
+    case Operation::JMP_NOT_EQUAL: return !zf;
+    case Operation::JMP_NOT_LESS: return sf == of;
+    case Operation::JMP_NOT_LESS_OR_EQUAL: return !zf && sf == of;
+    case Operation::JMP_NOT_BELOW: return !cf;
+    case Operation::JMP_NOT_BELOW_OR_EQUAL: return !cf && !zf;
+    case Operation::JMP_NOT_PARITY: return !pf;
+    case Operation::JMP_NOT_OVERFLOW: return !of;
+    case Operation::JMP_NOT_SIGN: return !sf;
+    default:
+      std::cerr << std::format("{}: Not a conditional jump\n", __LINE__);
+      std::exit(EXIT_FAILURE);
+  }
+}
+
+
+/*
+ * Evaluates a conditional jump directly from the operands of the SUB or CMP
+ * before it, a - b = r, without building the flags word. Must agree with
+ * condition_holds(op, materialize_flags(...)) for every input.
+ */
+bool compare_condition_holds(Operation op, u16 a, u16 b, u16 r, bool wide) {
+  u16 sign = wide ? 0x8000 : 0x80;
+  bool less = wide ? I16(a) < I16(b) : I8(a) < I8(b);
+  switch (op) {
+    case Operation::JMP_EQUAL: return a == b;
+    case Operation::JMP_LESS: return less;
+    case Operation::JMP_LESS_OR_EQUAL: return less || a == b;
+    case Operation::JMP_BELOW: return a < b;
+    case Operation::JMP_BELOW_OR_EQUAL: return a <= b;
+    case Operation::JMP_PARITY: return even_parity(r);
+    case Operation::JMP_OVERFLOW: return (a ^ b) & (a ^ r) & sign;
+    case Operation::JMP_SIGN: return r & sign;
+    case Operation::JMP_NOT_EQUAL: return a != b;
+    case Operation::JMP_NOT_LESS: return !less;
+    case Operation::JMP_NOT_LESS_OR_EQUAL: return !less && a != b;
+    case Operation::JMP_NOT_BELOW: return a >= b;
+    case Operation::JMP_NOT_BELOW_OR_EQUAL: return a > b;
+    case Operation::JMP_NOT_PARITY: return !even_parity(r);
+    case Operation::JMP_NOT_OVERFLOW: return !((a ^ b) & (a ^ r) & sign);
+    case Operation::JMP_NOT_SIGN: return !(r & sign);
+    default:
+      std::cerr << std::format("{}: Not a conditional jump\n", __LINE__);
+      std::exit(EXIT_FAILURE);
+  }
+}
+
+
+bool is_conditional_jump(Operation op) {
+  return op >= Operation::JMP_EQUAL && op <= Operation::JMP_NOT_SIGN;
+}
+
+
+bool is_loop(Operation op) {
+  return op == Operation::LOOP || op == Operation::LOOPZ || op == Operation::LOOPNZ;
+}
+
+
+/* Executes a data instruction (MOV, ADD, SUB or CMP). */
+void execute_data(Cpu& cpu, GuestMemory& memory, const Instruction& instruction) {
+  u16 b = read_operand(cpu, memory, instruction.source, instruction.wide);
+  if (instruction.mnemonic == Mnemonic::MOV) {
+    write_operand(cpu, memory, instruction.destination, instruction.wide, b);
+    return;
+  }
+  u16 a = read_operand(cpu, memory, instruction.destination, instruction.wide);
+  u16 mask = instruction.wide ? 0xFFFF : 0xFF;
+  u16 r = U16((instruction.mnemonic == Mnemonic::ADD ? a + b : a - b) & mask);
+  cpu.flags = {instruction.mnemonic, instruction.wide, a, b, r};
+  if (instruction.mnemonic != Mnemonic::CMP) {
+    write_operand(cpu, memory, instruction.destination, instruction.wide, r);
+  }
+}
+
+
+/* Executes a jump or loop, returning whether the branch was taken. */
+bool execute_jump(Cpu& cpu, const Instruction& instruction) {
+  bool taken = false;
+  u16& cx = cpu.registers[1];
+  switch (instruction.operation) {
+    case Operation::LOOP:
+      taken = --cx != 0;
+      break;
+    case Operation::LOOPZ:
+      taken = --cx != 0 && (materialize_flags(cpu.flags) & FLAG_ZERO);
+      break;
+    case Operation::LOOPNZ:
+      taken = --cx != 0 && !(materialize_flags(cpu.flags) & FLAG_ZERO);
+      break;
+    case Operation::JMP_CX_ZERO:
+      taken = cx == 0;
+      break;
+    default:
+      taken = condition_holds(instruction.operation, materialize_flags(cpu.flags));
+      break;
+  }
+  if (taken) {
+    cpu.ip = U16(cpu.ip + instruction.source.immediate);
+  }
+  return taken;
+}
+
+
+bool execute(Cpu& cpu, GuestMemory& memory, const Instruction& instruction) {
+  cpu.ip = U16(instruction.address + instruction.size);
+  if (instruction.mnemonic == Mnemonic::JUMP) {
+    return execute_jump(cpu, instruction);
+  }
+  execute_data(cpu, memory, instruction);
+  return false;
+}
+
+
+/*
+ * Superinstructions formed at pre-decode time. A fused slot executes its own
+ * instruction and the one after it in a single dispatch; the second
+ * instruction keeps its own SINGLE slot so jumps landing on it still work.
+ *
+ * COMPARE_BRANCH: SUB or CMP followed by a conditional jump. The condition
+ *                 comes straight from the operands; the flags are left lazy.
+ * LOOP_TAIL:      Any data instruction followed by LOOP, LOOPZ or LOOPNZ,
+ *                 i.e. the last instruction of a counted loop body.
+ */
+enum class Dispatch : u8 {
+  SINGLE,
+  COMPARE_BRANCH,
+  LOOP_TAIL
+};
+
+
+struct ExecutionStats {
+  u64 instructions = 0;
+  u64 dispatches = 0;
+  u64 fused_compare_branch = 0;
+  u64 fused_loop_tail = 0;
+};
+
+
+/*
+ * The pre-decoded program: instructions in address order, their dispatch
+ * kinds, and an address to instruction index table for jump targets. Code is
+ * decoded once up front, so self-modifying code is not supported.
+ */
+struct Program {
+  std::vector<Instruction> instructions {};
+  std::vector<Dispatch> dispatch {};
+  std::vector<u32> index_of_address {};
+};
+
+
+constexpr u32 NOT_AN_INSTRUCTION = 0xFFFFFFFF;
+
+
+/* Code runs with CS = 0 and a 16-bit IP, so it can only span one segment. */
+constexpr size_t MAX_EXECUTABLE_IMAGE_SIZE = 0x10000;
+
+
+Program predecode(std::vector<Instruction> instructions, size_t image_size, bool fuse) {
+  Program program {};
+  program.instructions = std::move(instructions);
+  program.dispatch.assign(program.instructions.size(), Dispatch::SINGLE);
+  program.index_of_address.assign(image_size, NOT_AN_INSTRUCTION);
+  for (size_t i = 0; i < program.instructions.size(); i++) {
+    program.index_of_address[program.instructions[i].address] = U32(i);
+  }
+  if (!fuse) {
+    return program;
+  }
+  for (size_t i = 0; i + 1 < program.instructions.size(); i++) {
+    const Instruction& first = program.instructions[i];
+    const Instruction& second = program.instructions[i + 1];
+    if (first.mnemonic == Mnemonic::JUMP) {
+      continue;
+    }
+    bool compares = first.mnemonic == Mnemonic::SUB || first.mnemonic == Mnemonic::CMP;
+    if (compares && is_conditional_jump(second.operation)) {
+      program.dispatch[i] = Dispatch::COMPARE_BRANCH;
+    } else if (is_loop(second.operation)) {
+      program.dispatch[i] = Dispatch::LOOP_TAIL;
+    }
+  }
+  return program;
+}
+
+
+/* SUB or CMP and the conditional jump after it, as one dispatch. */
+void execute_compare_branch(Cpu& cpu, GuestMemory& memory, const Instruction& compare, const Instruction& jump) {
+  bool wide = compare.wide;
+  u16 a = read_operand(cpu, memory, compare.destination, wide);
+  u16 b = read_operand(cpu, memory, compare.source, wide);
+  u16 r = U16((a - b) & (wide ? 0xFFFF : 0xFF));
+  cpu.flags = {compare.mnemonic, wide, a, b, r};
+  if (compare.mnemonic == Mnemonic::SUB) {
+    write_operand(cpu, memory, compare.destination, wide, r);
+  }
+  cpu.ip = U16(jump.address + jump.size);
+  if (compare_condition_holds(jump.operation, a, b, r, wide)) {
+    cpu.ip = U16(cpu.ip + jump.source.immediate);
+  }
+}
+
+
+/* Runs until IP leaves the program image. */
+void run(Cpu& cpu, GuestMemory& memory, const Program& program, ExecutionStats& stats) {
+  const std::vector<Instruction>& instructions = program.instructions;
+  while (cpu.ip < program.index_of_address.size()) {
+    u32 index = program.index_of_address[cpu.ip];
+    if (index == NOT_AN_INSTRUCTION) {
+      std::cerr << std::format("{}: Jump into the middle of an instruction at {}\n", __LINE__, cpu.ip);
+      std::exit(EXIT_FAILURE);
+    }
+    stats.dispatches++;
+    switch (program.dispatch[index]) {
+      case Dispatch::SINGLE:
+        execute(cpu, memory, instructions[index]);
+        stats.instructions++;
+        break;
+      case Dispatch::COMPARE_BRANCH:
+        execute_compare_branch(cpu, memory, instructions[index], instructions[index + 1]);
+        stats.instructions += 2;
+        stats.fused_compare_branch++;
+        break;
+      case Dispatch::LOOP_TAIL:
+        execute_data(cpu, memory, instructions[index]);
+        cpu.ip = U16(instructions[index + 1].address + instructions[index + 1].size);
+        execute_jump(cpu, instructions[index + 1]);
+        stats.instructions += 2;
+        stats.fused_loop_tail++;
+        break;
+    }
+  }
+}
+
+
+enum class CpuModel : u8 {
+  I8086,
+  I8088
+};
+
+
+/* Every bus cycle (T1-T4) takes four clocks. */
+constexpr u64 BUS_CYCLE_CLOCKS = 4;
+
+
+/*
+ * Timing-relevant facts about one execution of an instruction, captured
+ * before it runs so the effective address reflects the registers it used.
+ */
+struct BusAccess {
+  u32 clocks = 0;
+  u32 ea_clocks = 0;
+  u32 branch_resolve_clocks = 0;
+  u8 transfers = 0;
+  bool wide = false;
+  u16 address = 0;
+};
+
+
+/* Table 2-20. Effective Address Calculation Time. */
+u32 ea_clocks(const Operand& operand) {
+  if (operand.direct) {
+    return 6;
+  }
+  bool displaced = operand.displacement_bytes != 0;
+  switch (operand.rm) {
+    case 0b000:
+    case 0b011:
+      return displaced ? 11 : 7;
+    case 0b001:
+    case 0b010:
+      return displaced ? 12 : 8;
+    default:
+      return displaced ? 9 : 5;
+  }
+}
+
+
+/*
+ * Table 2-21. Instruction Set Reference Data. The clocks assume the
+ * instruction is already in the queue and include the EA calculation and one
+ * bus cycle per memory transfer; word transfers that need two bus cycles are
+ * charged separately by the bus model.
+ */
+BusAccess bus_access(const Cpu& cpu, const Instruction& instruction, bool taken) {
+  BusAccess access {};
+  const Operand& destination = instruction.destination;
+  const Operand& source = instruction.source;
+  access.wide = instruction.wide;
+
+  if (instruction.mnemonic == Mnemonic::JUMP) {
+    /* The not-taken time is also when a taken branch has been resolved. */
+    switch (instruction.operation) {
+      case Operation::LOOP: access.clocks = taken ? 17 : 5; access.branch_resolve_clocks = 5; break;
+      case Operation::LOOPZ: access.clocks = taken ? 18 : 6; access.branch_resolve_clocks = 6; break;
+      case Operation::LOOPNZ: access.clocks = taken ? 19 : 5; access.branch_resolve_clocks = 5; break;
+      case Operation::JMP_CX_ZERO: access.clocks = taken ? 18 : 6; access.branch_resolve_clocks = 6; break;
+      default: access.clocks = taken ? 16 : 4; access.branch_resolve_clocks = 4; break;
+    }
+    return access;
+  }
+
+  bool acc_form = instruction.operation == Operation::MEM_TO_ACC
+    || instruction.operation == Operation::ACC_TO_MEM;
+  const Operand* memory = destination.kind == OperandKind::MEMORY ? &destination
+    : source.kind == OperandKind::MEMORY ? &source : nullptr;
+  if (memory) {
+    access.address = effective_address(cpu, *memory);
+    access.ea_clocks = acc_form ? 0 : ea_clocks(*memory);
+  }
+
+  bool to_memory = destination.kind == OperandKind::MEMORY;
+  bool immediate = source.kind == OperandKind::IMMEDIATE;
+  switch (instruction.mnemonic) {
+    case Mnemonic::MOV:
+      if (acc_form) access.clocks = 10;
+      else if (!memory) access.clocks = immediate ? 4 : 2;
+      else if (immediate) access.clocks = 10;
+      else access.clocks = to_memory ? 9 : 8;
+      access.transfers = memory ? 1 : 0;
+      break;
+    case Mnemonic::ADD:
+    case Mnemonic::SUB:
+      if (!memory) access.clocks = immediate ? 4 : 3;
+      else if (immediate) access.clocks = 17;
+      else access.clocks = to_memory ? 16 : 9;
+      access.transfers = memory ? (to_memory ? 2 : 1) : 0;
+      break;
+    case Mnemonic::CMP:
+      if (!memory) access.clocks = immediate ? 4 : 3;
+      else access.clocks = immediate ? 10 : 9;
+      access.transfers = memory ? 1 : 0;
+      break;
+    default:
+      break;
+  }
+  access.clocks += access.ea_clocks;
+  return access;
+}
+
+
+/* Per static instruction totals reported by --bus-model. */
+struct InstructionCycles {
+  u64 executions = 0;
+  u64 clocks = 0;
+  u64 fetch_stalls = 0;
+  u64 bus_stalls = 0;
+};
+
+
+/*
+ * The bus interface unit. The BIU fills the prefetch queue whenever the bus
+ * is idle and there is room for a fetch (two bytes from an even address on
+ * the 8086, one byte on the 8088), while the execution unit drains it. Each
+ * queued byte carries the clock it arrives at, so the EU stalls exactly as
+ * long as it waits for its bytes or for a bus cycle already in flight.
+ * Taken branches flush the queue.
+ */
+struct BusModel {
+  CpuModel model = CpuModel::I8086;
+  u8 queue_capacity = 6;
+  u64 clock = 0;
+  u64 bus_free = 0;
+  u32 fetch_address = 0;
+  std::array<u64, 8> arrival {};
+  u8 head = 0;
+  u8 count = 0;
+  std::vector<InstructionCycles> cycles {};
+};
+
+
+BusModel make_bus_model(CpuModel model, size_t instruction_count) {
+  BusModel bus {};
+  bus.model = model;
+  bus.queue_capacity = model == CpuModel::I8086 ? 6 : 4;
+  bus.cycles.resize(instruction_count);
+  return bus;
+}
+
+
+u8 fetch_width(const BusModel& bus) {
+  if (bus.model == CpuModel::I8088) {
+    return 1;
+  }
+  return (bus.fetch_address & 1) ? 1 : 2;
+}
+
+
+void fetch(BusModel& bus, u64 start) {
+  u64 done = start + BUS_CYCLE_CLOCKS;
+  for (u8 i = fetch_width(bus); i > 0; i--) {
+    bus.arrival[(bus.head + bus.count) % bus.arrival.size()] = done;
+    bus.count++;
+    bus.fetch_address++;
+  }
+  bus.bus_free = done;
+}
+
+
+/* Runs the prefetch cycles the BIU gets to start before the given clock. */
+void prefetch(BusModel& bus, u64 until) {
+  while (bus.bus_free < until && bus.count + fetch_width(bus) <= bus.queue_capacity) {
+    fetch(bus, bus.bus_free);
+  }
+}
+
+
+/* Advances the model over one executed instruction. */
+void bus_step(BusModel& bus, u32 index, const Instruction& instruction, const BusAccess& access, bool taken, u16 next_ip) {
+  u64 ready = bus.clock;
+  prefetch(bus, ready);
+  /* Instructions longer than the 8088 queue stream through it. */
+  while (bus.count < instruction.size) {
+    fetch(bus, std::max(bus.bus_free, ready));
+  }
+  u64 last_byte = bus.arrival[(bus.head + instruction.size - 1) % bus.arrival.size()];
+  u64 start = std::max(ready, last_byte);
+  bus.head = (bus.head + instruction.size) % bus.arrival.size();
+  bus.count -= instruction.size;
+  /* If the bus sat idle behind a full queue, the freed space restarts it. */
+  bus.bus_free = std::max(bus.bus_free, start);
+
+  u64 bus_stall = 0;
+  u64 penalty = 0;
+  u64 request = start + access.ea_clocks;
+  for (u8 i = 0; i < access.transfers; i++) {
+    prefetch(bus, request);
+    u64 begin = std::max(request, bus.bus_free);
+    bus_stall += begin - request;
+    /* A word at an odd address on the 8086, or any word on the 8088, takes
+     * a second bus cycle. */
+    bool split = access.wide && (bus.model == CpuModel::I8088 || (access.address & 1));
+    u64 length = split ? 2 * BUS_CYCLE_CLOCKS : BUS_CYCLE_CLOCKS;
+    penalty += length - BUS_CYCLE_CLOCKS;
+    bus.bus_free = begin + length;
+    request = bus.bus_free;
+  }
+
+  u64 end = start + access.clocks + penalty + bus_stall;
+  if (taken) {
+    /* The EU flushes the queue once the branch resolves; the fetch already on
+     * the bus completes but its bytes are discarded. */
+    bus.count = 0;
+    bus.fetch_address = next_ip;
+    bus.bus_free = std::max(bus.bus_free, start + access.branch_resolve_clocks);
+  }
+  bus.clock = end;
+
+  InstructionCycles& cycles = bus.cycles[index];
+  cycles.executions++;
+  cycles.clocks += end - ready;
+  cycles.fetch_stalls += start - ready;
+  cycles.bus_stalls += bus_stall;
+}
+
+
+/* Like run(), one instruction per dispatch so each can be timed. */
+void run_bus_model(Cpu& cpu, GuestMemory& memory, const Program& program, ExecutionStats& stats, BusModel& bus) {
+  const std::vector<Instruction>& instructions = program.instructions;
+  bus.fetch_address = cpu.ip;
+  while (cpu.ip < program.index_of_address.size()) {
+    u32 index = program.index_of_address[cpu.ip];
+    if (index == NOT_AN_INSTRUCTION) {
+      std::cerr << std::format("{}: Jump into the middle of an instruction at {}\n", __LINE__, cpu.ip);
+      std::exit(EXIT_FAILURE);
+    }
+    const Instruction& instruction = instructions[index];
+    Cpu before = cpu;
+    bool taken = execute(cpu, memory, instruction);
+    bus_step(bus, index, instruction, bus_access(before, instruction, taken), taken, cpu.ip);
+    stats.dispatches++;
+    stats.instructions++;
+  }
+}
+
+
+void print_bus_model(const BusModel& bus, const Program& program, std::vector<u8>& program_data) {
+  std::cout << std::format(
+    "Bus model: {}, {}-byte queue\n",
+    bus.model == CpuModel::I8086 ? "8086" : "8088", bus.queue_capacity
+  );
+  std::cout << "  address    count     clocks  fetch stall    bus stall  instruction\n";
+  InstructionCycles total {};
+  for (size_t i = 0; i < program.instructions.size(); i++) {
+    const InstructionCycles& cycles = bus.cycles[i];
+    if (!cycles.executions) {
+      continue;
+    }
+    const Instruction& instruction = program.instructions[i];
+    std::vector<u8> bytes(
+      program_data.begin() + instruction.address,
+      program_data.begin() + instruction.address + instruction.size
+    );
+    std::string text = disassemble(get_opcode_name(instruction.operation), instruction.operation, bytes);
+    text.pop_back();
+    std::cout << std::format(
+      "  {:#06x} {:>8} {:>10} {:>12} {:>12}  {}\n",
+      instruction.address, cycles.executions, cycles.clocks,
+      cycles.fetch_stalls, cycles.bus_stalls, text
+    );
+    total.clocks += cycles.clocks;
+    total.fetch_stalls += cycles.fetch_stalls;
+    total.bus_stalls += cycles.bus_stalls;
+  }
+  std::cout << std::format(
+    "  total clocks: {} (fetch stalls {}, bus stalls {})\n",
+    total.clocks, total.fetch_stalls, total.bus_stalls
+  );
+}
+
+
+void print_registers(const Cpu& cpu) {
+  static constexpr std::array<const char*, 8> NAMES {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di"};
+  std::cout << "Final registers:\n";
+  for (size_t i = 0; i < NAMES.size(); i++) {
+    if (cpu.registers[i]) {
+      std::cout << std::format("      {}: {:#06x} ({})\n", NAMES[i], cpu.registers[i], cpu.registers[i]);
+    }
+  }
+  std::cout << std::format("      ip: {:#06x} ({})\n", cpu.ip, cpu.ip);
+  u16 flags = materialize_flags(cpu.flags);
+  std::string flag_names {};
+  static constexpr std::array<std::pair<u16, char>, 6> FLAG_NAMES {{
+    {FLAG_CARRY, 'C'}, {FLAG_PARITY, 'P'}, {FLAG_AUXILIARY, 'A'},
+    {FLAG_ZERO, 'Z'}, {FLAG_SIGN, 'S'}, {FLAG_OVERFLOW, 'O'}
+  }};
+  for (const auto& [bit, name] : FLAG_NAMES) {
+    if (flags & bit) {
+      flag_names += name;
+    }
+  }
+  if (!flag_names.empty()) {
+    std::cout << std::format("   flags: {}\n", flag_names);
+  }
+}
+
+
+void print_stats(const ExecutionStats& stats) {
+  u64 saved = stats.instructions - stats.dispatches;
+  double percent = stats.instructions ? 100.0 * saved / stats.instructions : 0.0;
+  std::cout << std::format(
+    "Stats:\n"
+    "  instructions:          {}\n"
+    "  dispatches:            {}\n"
+    "  fused compare/branch:  {}\n"
+    "  fused loop tail:       {}\n"
+    "  dispatches saved:      {} ({:.1f}%)\n",
+    stats.instructions, stats.dispatches, stats.fused_compare_branch,
+    stats.fused_loop_tail, saved, percent
+  );
+}
+
+
+/* How a displacement is encoded; the shortest form is what assemblers emit. */
+enum class DisplacementForm : u8 {
+  SHORTEST,
+  BYTE,
+  WORD
+};
+
+
+/*
+ * Encoding choices that the structured form of an instruction leaves open.
+ *
+ * direction:     Register to register forms: set D, so REG names the
+ *                destination instead of the source.
+ * sign_extend:   ASC_IMM_TO_REGMEM: set S. Wide immediates must then fit in
+ *                a byte; with W clear it selects the 0x82 alias of 0x80.
+ * displacement:  Memory operands other than direct addresses.
+ */
+struct EncodingForm {
+  bool direction = false;
+  bool sign_extend = false;
+  DisplacementForm displacement = DisplacementForm::SHORTEST;
+};
+
+
+bool fits_in_byte(i16 value) {
+  return value >= -128 && value <= 127;
+}
+
+
+u8 opcode_base(Operation op) {
+  for (const Opcode& o : opcodes) {
+    if (o.operation == op) {
+      return U8(o.bits << (8 - o.length));
+    }
+  }
+  std::cerr << std::format("{}: Unrecognized opcode: {}\n", __LINE__, to_underlying(op));
+  std::exit(EXIT_FAILURE);
+}
+
+
+/* Table 4-08. The MOD field a memory operand is encoded with. */
+u8 displacement_mod(const Operand& operand, DisplacementForm form) {
+  if (operand.kind == OperandKind::REGISTER) {
+    return 0b11;
+  }
+  if (operand.direct) {
+    return 0b00;
+  }
+  switch (form) {
+    case DisplacementForm::BYTE:
+      return 0b01;
+    case DisplacementForm::WORD:
+      return 0b10;
+    default:
+      if (operand.displacement == 0 && operand.rm != 0b110) {
+        return 0b00;
+      }
+      return fits_in_byte(operand.displacement) ? 0b01 : 0b10;
+  }
+}
+
+
+/* Writes the MOD REG R/M byte and any displacement, returning the end index. */
+u8 encode_regmem(u8 reg, const Operand& operand, DisplacementForm form, std::array<u8, 6>& bytes) {
+  u8 mod = displacement_mod(operand, form);
+  u8 rm = operand.kind == OperandKind::REGISTER ? operand.reg & 0b111 : operand.rm;
+  if (operand.direct) {
+    rm = 0b110;
+  }
+  bytes[1] = U8((mod << 6) | ((reg & 0b111) << 3) | rm);
+  u16 displacement = U16(operand.displacement);
+  switch (num_displacement_bytes(mod, rm)) {
+    case 1:
+      bytes[2] = U8(displacement);
+      return 3;
+    case 2:
+      bytes[2] = U8(displacement);
+      bytes[3] = U8(displacement >> 8);
+      return 4;
+    default:
+      return 2;
+  }
+}
+
+
+u8 encode_immediate(i16 value, bool wide, std::array<u8, 6>& bytes, u8 index) {
+  bytes[index] = U8(value);
+  if (wide) {
+    bytes[index + 1] = U8(U16(value) >> 8);
+    return index + 2;
+  }
+  return index + 1;
+}
+
+
+/* The inverse of decode_instruction(). Returns the encoded length. */
+u8 encode_instruction(const Instruction& instruction, const EncodingForm& form, std::array<u8, 6>& bytes) {
+  Operation op = instruction.operation;
+  const Operand& destination = instruction.destination;
+  const Operand& source = instruction.source;
+  bool wide = instruction.wide;
+  u8 base = opcode_base(op);
+
+  switch (op) {
+    case Operation::REGMEM_TO_FROM_REG:
+    case Operation::ADD_REGMEM_WITH_REG:
+    case Operation::SUB_REGMEM_WITH_REG:
+    case Operation::CMP_REGMEM_AND_REG: {
+      bool direction = source.kind == OperandKind::MEMORY
+        || (destination.kind == OperandKind::REGISTER && source.kind == OperandKind::REGISTER && form.direction);
+      const Operand& reg = direction ? destination : source;
+      const Operand& regmem = direction ? source : destination;
+      bytes[0] = U8(base | (direction << 1) | wide);
+      return encode_regmem(reg.reg, regmem, form.displacement, bytes);
+    }
+    case Operation::IMM_TO_REGMEM: {
+      bytes[0] = U8(base | wide);
+      u8 end = encode_regmem(0b000, destination, form.displacement, bytes);
+      return encode_immediate(source.immediate, wide, bytes, end);
+    }
+    case Operation::ASC_IMM_TO_REGMEM: {
+      u8 reg = instruction.mnemonic == Mnemonic::ADD ? 0b000
+        : instruction.mnemonic == Mnemonic::SUB ? 0b101 : 0b111;
+      bytes[0] = U8(base | (form.sign_extend << 1) | wide);
+      u8 end = encode_regmem(reg, destination, form.displacement, bytes);
+      return encode_immediate(source.immediate, wide && !form.sign_extend, bytes, end);
+    }
+    case Operation::IMM_TO_REG:
+      bytes[0] = U8(base | (wide << 3) | (destination.reg & 0b111));
+      return encode_immediate(source.immediate, wide, bytes, 1);
+    case Operation::MEM_TO_ACC:
+    case Operation::ACC_TO_MEM: {
+      const Operand& memory = op == Operation::MEM_TO_ACC ? source : destination;
+      bytes[0] = U8(base | wide);
+      return encode_immediate(memory.displacement, true, bytes, 1);
+    }
+    case Operation::ADD_IMM_TO_ACC:
+    case Operation::SUB_IMM_FROM_ACC:
+    case Operation::CMP_IMM_WITH_ACC:
+      bytes[0] = U8(base | wide);
+      return encode_immediate(source.immediate, wide, bytes, 1);
+    default:
+      bytes[0] = base;
+      bytes[1] = U8(source.immediate);
+      return 2;
+  }
+}
+
+
+/*
+ * Canonical NASM text for an instruction, built from the structured form
+ * alone. disassemble() must produce exactly this, so these tables and the
+ * displacement formatting deliberately share nothing with the disassembler.
+ */
+std::string format_operand(const Operand& operand, bool wide) {
+  static constexpr std::array<const char*, 16> REGISTERS {
+    "al", "cl", "dl", "bl", "ah", "ch", "dh", "bh",
+    "ax", "cx", "dx", "bx", "sp", "bp", "si", "di"
+  };
+  static constexpr std::array<const char*, 8> BASES {
+    "bx + si", "bx + di", "bp + si", "bp + di", "si", "di", "bp", "bx"
+  };
+  switch (operand.kind) {
+    case OperandKind::REGISTER:
+      return REGISTERS[operand.reg];
+    case OperandKind::MEMORY: {
+      if (operand.direct) {
+        return std::format("[{}]", U16(operand.displacement));
+      }
+      int displacement = operand.displacement;
+      if (displacement > 0) {
+        return std::format("[{} + {}]", BASES[operand.rm], displacement);
+      } else if (displacement < 0) {
+        return std::format("[{} - {}]", BASES[operand.rm], -displacement);
+      }
+      return std::format("[{}]", BASES[operand.rm]);
+    }
+    case OperandKind::IMMEDIATE:
+      return wide ? std::format("{}", operand.immediate) : std::format("{}", I8(operand.immediate));
+    default:
+      return "";
+  }
+}
+
+
+std::string format_instruction(const Instruction& instruction) {
+  static constexpr std::array<const char*, 4> NAMES {"mov", "add", "sub", "cmp"};
+  /* In Operation order, from JMP_EQUAL to JMP_CX_ZERO. */
+  static constexpr std::array<const char*, 20> JUMP_NAMES {
+    "je", "jl", "jle", "jb", "jbe", "jp", "jo", "js",
+    "jne", "jnl", "jnle", "jnb", "jnbe", "jnp", "jno", "jns",
+    "loop", "loopz", "loopnz", "jcxz"
+  };
+  if (instruction.mnemonic == Mnemonic::JUMP) {
+    size_t jump = SIZE(to_underlying(instruction.operation) - to_underlying(Operation::JMP_EQUAL));
+    return std::format("{} {}\n", JUMP_NAMES[jump], I8(instruction.source.immediate));
+  }
+  bool sized = instruction.destination.kind == OperandKind::MEMORY
+    && instruction.source.kind == OperandKind::IMMEDIATE;
+  return std::format(
+    "{} {}{}, {}\n",
+    NAMES[to_underlying(instruction.mnemonic)],
+    sized ? (instruction.wide ? "word " : "byte ") : "",
+    format_operand(instruction.destination, instruction.wide),
+    format_operand(instruction.source, instruction.wide)
+  );
+}
+
+
+/* Boundary values for displacements, addresses and immediates. */
+constexpr std::array<i16, 5> BYTE_BOUNDARIES {0, 1, -1, 127, -128};
+constexpr std::array<i16, 12> WORD_BOUNDARIES {
+  0, 1, -1, 127, -128, 128, -129, 255, 256, 0x1234, 32767, -32768
+};
+
+
+/*
+ * A unit of verification work: one operation, mnemonic and width with one
+ * fixed R/M operand. Units are the granularity work is shared across threads
+ * at; classes are what mismatches are reported per.
+ */
+struct VerifyUnit {
+  Operation operation;
+  Mnemonic mnemonic;
+  bool wide;
+  Operand regmem;
+  size_t class_index;
+};
+
+
+struct VerifyResult {
+  u64 cases = 0;
+  bool failed = false;
+  std::string mismatch {};
+};
+
+
+std::vector<Operand> verify_regmem_operands(bool wide) {
+  std::vector<Operand> operands {};
+  for (u8 reg = 0; reg < 8; reg++) {
+    operands.push_back(register_operand(reg + (wide << 3)));
+  }
+  for (i16 address : WORD_BOUNDARIES) {
+    Operand operand {};
+    operand.kind = OperandKind::MEMORY;
+    operand.rm = 0b110;
+    operand.direct = true;
+    operand.displacement = address;
+    operands.push_back(operand);
+  }
+  for (u8 rm = 0; rm < 8; rm++) {
+    for (i16 displacement : WORD_BOUNDARIES) {
+      Operand operand {};
+      operand.kind = OperandKind::MEMORY;
+      operand.rm = rm;
+      operand.displacement = displacement;
+      operands.push_back(operand);
+    }
+  }
+  return operands;
+}
+
+
+std::string verify_class_name(Operation op, Mnemonic mnemonic, bool wide, const Operand& regmem) {
+  static constexpr std::array<const char*, 5> NAMES {"mov", "add", "sub", "cmp", "jump"};
+  std::string label = to_string(op);
+  if (label == "Unknown Operation") {
+    label = get_opcode_name(op);
+  }
+  std::string form {};
+  if (regmem.kind == OperandKind::REGISTER) {
+    form = ", register";
+  } else if (regmem.kind == OperandKind::MEMORY) {
+    form = regmem.direct ? ", direct address" : std::format(", mod {:02b}", displacement_mod(regmem, DisplacementForm::SHORTEST));
+  }
+  return std::format("{} ({}{}{})", NAMES[to_underlying(mnemonic)], label, wide ? ", wide" : "", form);
+}
+
+
+std::vector<VerifyUnit> verify_units(std::vector<std::string>& classes) {
+  std::unordered_map<std::string, size_t> class_indices {};
+  std::vector<VerifyUnit> units {};
+  auto add = [&](Operation op, Mnemonic mnemonic, bool wide, const Operand& regmem) {
+    std::string name = verify_class_name(op, mnemonic, wide, regmem);
+    auto [it, inserted] = class_indices.emplace(name, classes.size());
+    if (inserted) {
+      classes.push_back(name);
+    }
+    units.push_back({op, mnemonic, wide, regmem, it->second});
+  };
+  for (const Opcode& o : opcodes) {
+    Operation op = o.operation;
+    for (bool wide : {false, true}) {
+      switch (op) {
+        case Operation::REGMEM_TO_FROM_REG:
+        case Operation::ADD_REGMEM_WITH_REG:
+        case Operation::SUB_REGMEM_WITH_REG:
+        case Operation::CMP_REGMEM_AND_REG:
+        case Operation::IMM_TO_REGMEM: {
+          std::vector<u8> probe {opcode_base(op), 0};
+          for (const Operand& regmem : verify_regmem_operands(wide)) {
+            add(op, get_mnemonic(op, probe), wide, regmem);
+          }
+          break;
+        }
+        case Operation::ASC_IMM_TO_REGMEM:
+          for (Mnemonic mnemonic : {Mnemonic::ADD, Mnemonic::SUB, Mnemonic::CMP}) {
+            for (const Operand& regmem : verify_regmem_operands(wide)) {
+              add(op, mnemonic, wide, regmem);
+            }
+          }
+          break;
+        default: {
+          std::vector<u8> probe {opcode_base(op), 0};
+          Mnemonic mnemonic = get_mnemonic(op, probe);
+          /* Jumps have no width; enumerate them once. */
+          if (mnemonic != Mnemonic::JUMP || !wide) {
+            add(op, mnemonic, wide && mnemonic != Mnemonic::JUMP, Operand {});
+          }
+          break;
+        }
+      }
+    }
+  }
+  return units;
+}
+
+
+/* Encodes one case and checks every decoder path against it. */
+bool verify_case(Instruction expected, const EncodingForm& form, std::string& mismatch) {
+  std::array<u8, 6> encoded {};
+  u8 length = encode_instruction(expected, form, encoded);
+  expected.size = length;
+  for (Operand* operand : {&expected.destination, &expected.source}) {
+    if (operand->kind == OperandKind::MEMORY) {
+      operand->displacement_bytes = operand->direct ? 2
+        : num_displacement_bytes(displacement_mod(*operand, form.displacement), operand->rm);
+    }
+  }
+  std::vector<u8> bytes(encoded.begin(), encoded.begin() + length);
+
+  std::string hex {};
+  for (u8 byte : bytes) {
+    hex += std::format("{:02x} ", byte);
+  }
+  /* Only the non-exiting paths are used, so a decoder regression shows up as
+   * this class's mismatch instead of ending the run. */
+  Operation op {};
+  std::string error {};
+  size_t size = checked_instruction_size(bytes, 0, op, error);
+  if (!size) {
+    mismatch = std::format("{}: {}", hex, error);
+    return false;
+  }
+  if (op != expected.operation) {
+    mismatch = std::format("{}: find_opcode gave {}", hex, get_opcode_name(op));
+    return false;
+  }
+  if (size != length) {
+    mismatch = std::format("{}: instruction_size {}, expected {}", hex, size, length);
+    return false;
+  }
+  if (decode_instruction(op, bytes, 0) != expected) {
+    mismatch = std::format("{}: decode_instruction does not round-trip", hex);
+    return false;
+  }
+  std::string text {};
+  if (!try_disassemble_at(bytes, 0, text, error)) {
+    mismatch = std::format("{}: {}", hex, error);
+    return false;
+  }
+  std::string canonical = format_instruction(expected);
+  if (text != canonical) {
+    text.pop_back();
+    canonical.pop_back();
+    mismatch = std::format("{}: disassemble gave `{}`, expected `{}`", hex, text, canonical);
+    return false;
+  }
+  return true;
+}
+
+
+/* Runs every case of a unit, stopping at its first mismatch. */
+void verify_unit(const VerifyUnit& unit, VerifyResult& result) {
+  Instruction instruction {};
+  instruction.operation = unit.operation;
+  instruction.mnemonic = unit.mnemonic;
+  instruction.wide = unit.wide;
+
+  std::vector<DisplacementForm> displacements {DisplacementForm::SHORTEST};
+  const Operand& regmem = unit.regmem;
+  if (regmem.kind == OperandKind::MEMORY && !regmem.direct) {
+    u8 mod = displacement_mod(regmem, DisplacementForm::SHORTEST);
+    if (mod == 0b00) {
+      displacements.push_back(DisplacementForm::BYTE);
+    }
+    if (mod != 0b10) {
+      displacements.push_back(DisplacementForm::WORD);
+    }
+  }
+  auto check = [&](const EncodingForm& form) {
+    if (result.failed) {
+      return;
+    }
+    result.cases++;
+    if (!verify_case(instruction, form, result.mismatch)) {
+      result.failed = true;
+    }
+  };
+  auto for_each_immediate = [&](bool sign_extendable, auto&& body) {
+    const i16* values = unit.wide ? WORD_BOUNDARIES.data() : BYTE_BOUNDARIES.data();
+    size_t count = unit.wide ? WORD_BOUNDARIES.size() : BYTE_BOUNDARIES.size();
+    for (size_t i = 0; i < count; i++) {
+      instruction.source = immediate_operand(values[i]);
+      body(false);
+      if (sign_extendable && (!unit.wide || fits_in_byte(values[i]))) {
+        body(true);
+      }
+    }
+  };
+
+  switch (unit.operation) {
+    case Operation::REGMEM_TO_FROM_REG:
+    case Operation::ADD_REGMEM_WITH_REG:
+    case Operation::SUB_REGMEM_WITH_REG:
+    case Operation::CMP_REGMEM_AND_REG:
+      for (u8 reg = 0; reg < 8; reg++) {
+        Operand other = register_operand(reg + (unit.wide << 3));
+        for (DisplacementForm displacement : displacements) {
+          for (bool direction : {false, true}) {
+            instruction.destination = regmem;
+            instruction.source = other;
+            check({direction, false, displacement});
+            instruction.destination = other;
+            instruction.source = regmem;
+            check({direction, false, displacement});
+          }
+        }
+      }
+      break;
+    case Operation::IMM_TO_REGMEM:
+    case Operation::ASC_IMM_TO_REGMEM: {
+      bool asc = unit.operation == Operation::ASC_IMM_TO_REGMEM;
+      instruction.destination = regmem;
+      for (DisplacementForm displacement : displacements) {
+        for_each_immediate(asc, [&](bool sign_extend) {
+          check({false, sign_extend, displacement});
+        });
+      }
+      break;
+    }
+    case Operation::IMM_TO_REG:
+      for (u8 reg = 0; reg < 8; reg++) {
+        instruction.destination = register_operand(reg + (unit.wide << 3));
+        for_each_immediate(false, [&](bool) { check({}); });
+      }
+      break;
+    case Operation::MEM_TO_ACC:
+    case Operation::ACC_TO_MEM:
+      for (i16 address : WORD_BOUNDARIES) {
+        Operand memory {};
+        memory.kind = OperandKind::MEMORY;
+        memory.rm = 0b110;
+        memory.direct = true;
+        memory.displacement = address;
+        Operand accumulator = register_operand(unit.wide << 3);
+        bool to_acc = unit.operation == Operation::MEM_TO_ACC;
+        instruction.destination = to_acc ? accumulator : memory;
+        instruction.source = to_acc ? memory : accumulator;
+        check({});
+      }
+      break;
+    case Operation::ADD_IMM_TO_ACC:
+    case Operation::SUB_IMM_FROM_ACC:
+    case Operation::CMP_IMM_WITH_ACC:
+      instruction.destination = register_operand(unit.wide << 3);
+      for_each_immediate(false, [&](bool) { check({}); });
+      break;
+    default:
+      for (int displacement = -128; displacement < 128; displacement++) {
+        instruction.source = immediate_operand(I16(displacement));
+        check({});
+      }
+      break;
+  }
+}
+
+
+/*
+ * Round-trips every legal opcode, MOD REG R/M, width and sign combination,
+ * with boundary displacements and immediates, through the encoder and every
+ * decoder path, on all cores. Reports the first mismatch of each class.
+ */
+/* Word operands for the fused condition check: the boundaries plus a stride. */
+constexpr u32 COMPARE_WORD_STRIDE = 131;
+
+
+/*
+ * Checks that the superinstruction's compare_condition_holds() agrees with
+ * condition_holds() on the materialized flags, for every condition after a
+ * SUB or CMP. Byte operands are checked exhaustively, word operands at the
+ * boundaries and on a strided sample.
+ */
+void verify_compare_branch(bool wide, VerifyResult& result) {
+  std::vector<u16> values {};
+  if (wide) {
+    for (i16 value : WORD_BOUNDARIES) {
+      values.push_back(U16(value));
+    }
+    for (u32 value = 0; value <= 0xFFFF; value += COMPARE_WORD_STRIDE) {
+      values.push_back(U16(value));
+    }
+  } else {
+    for (u16 value = 0; value <= 0xFF; value++) {
+      values.push_back(value);
+    }
+  }
+  u16 mask = wide ? 0xFFFF : 0xFF;
+  for (Mnemonic mnemonic : {Mnemonic::SUB, Mnemonic::CMP}) {
+    for (u16 a : values) {
+      for (u16 b : values) {
+        u16 r = U16((a - b) & mask);
+        u16 flags = materialize_flags({mnemonic, wide, a, b, r});
+        for (Operation op = Operation::JMP_EQUAL; op <= Operation::JMP_NOT_SIGN;
+             op = static_cast<Operation>(to_underlying(op) + 1)) {
+          result.cases++;
+          bool fused = compare_condition_holds(op, a, b, r, wide);
+          if (fused != condition_holds(op, flags)) {
+            result.failed = true;
+            result.mismatch = std::format(
+              "{} {:#x}, {:#x}: {} is {} fused, {} from the flags",
+              mnemonic == Mnemonic::SUB ? "sub" : "cmp", a, b, get_opcode_name(op), fused, !fused
+            );
+            return;
+          }
+        }
+      }
+    }
+  }
+}
+
+
+bool verify_decoder() {
+  auto started = std::chrono::steady_clock::now();
+  std::vector<std::string> classes {};
+  std::vector<VerifyUnit> units = verify_units(classes);
+  /* The two fused condition checks run as extra work items after the units. */
+  size_t compare_class = classes.size();
+  classes.push_back("jcc after sub/cmp (fused)");
+  classes.push_back("jcc after sub/cmp (fused, wide)");
+  size_t work_count = units.size() + 2;
+  std::vector<VerifyResult> results(work_count);
+  std::atomic<size_t> next_unit = 0;
+
+  unsigned int thread_count = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<std::thread> threads {};
+  for (unsigned int t = 0; t < thread_count; t++) {
+    threads.emplace_back([&]() {
+      for (size_t i = next_unit++; i < work_count; i = next_unit++) {
+        if (i < units.size()) {
+          verify_unit(units[i], results[i]);
+        } else {
+          verify_compare_branch(i - units.size() == 1, results[i]);
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  u64 cases = 0;
+  std::vector<const std::string*> first_mismatch(classes.size(), nullptr);
+  for (size_t i = 0; i < work_count; i++) {
+    cases += results[i].cases;
+    size_t c = i < units.size() ? units[i].class_index : compare_class + (i - units.size());
+    if (results[i].failed && !first_mismatch[c]) {
+      first_mismatch[c] = &results[i].mismatch;
+    }
+  }
+  size_t failed = 0;
+  for (size_t c = 0; c < classes.size(); c++) {
+    if (first_mismatch[c]) {
+      std::cout << std::format("{}\n  {}\n", classes[c], *first_mismatch[c]);
+      failed++;
+    }
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+  std::cout << std::format(
+    "Verified {} cases in {} classes on {} threads in {:.2f}s: {} classes with mismatches\n",
+    cases, classes.size(), thread_count, elapsed.count(), failed
+  );
+  return failed == 0;
+}
+
+
+/*
+ * Version of the decoder's output, part of every decode cache key. Bump it
+ * whenever decode_instruction() or the disassembly text changes.
+ */
+constexpr u32 DECODER_VERSION = 3;
+
+
+/* A fast hash of an image, used as its content address in the decode cache. */
+u64 hash_image(const std::vector<u8>& image) {
+  constexpr u64 K = 0x9E3779B97F4A7C15;
+  u64 hash = image.size() * K;
+  size_t i = 0;
+  for (; i + 8 <= image.size(); i += 8) {
+    u64 word;
+    std::memcpy(&word, image.data() + i, 8);
+    hash = std::rotl(hash ^ (word * K), 29) * K;
+  }
+  if (i < image.size()) {
+    u64 word = 0;
+    std::memcpy(&word, image.data() + i, image.size() - i);
+    hash = std::rotl(hash ^ (word * K), 29) * K;
+  }
+  hash ^= hash >> 32;
+  hash *= K;
+  return hash ^ (hash >> 29);
+}
+
+
+struct MappedFile {
+  const u8* data = nullptr;
+  size_t size = 0;
+};
+
+
+bool map_file_read_only(const std::filesystem::path& path, MappedFile& mapped) {
+#ifdef _WIN32
+  HANDLE file = CreateFileW(
+    path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+    nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr
+  );
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  LARGE_INTEGER size {};
+  if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+    CloseHandle(file);
+    return false;
+  }
+  HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  CloseHandle(file);
+  if (!mapping) {
+    return false;
+  }
+  void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  if (!view) {
+    return false;
+  }
+  mapped.size = SIZE(size.QuadPart);
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat status {};
+  if (fstat(fd, &status) != 0 || status.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void* view = mmap(nullptr, SIZE(status.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (view == MAP_FAILED) {
+    return false;
+  }
+  mapped.size = SIZE(status.st_size);
+#endif
+  mapped.data = static_cast<const u8*>(view);
+  return true;
+}
+
+
+void unmap_file(MappedFile& mapped) {
+  if (!mapped.data) {
+    return;
+  }
+#ifdef _WIN32
+  UnmapViewOfFile(mapped.data);
+#else
+  munmap(const_cast<u8*>(mapped.data), mapped.size);
+#endif
+  mapped = {};
+}
+
+
+/*
+ * On-disk decode cache. Each entry is one immutable file named after the
+ * image hash and DECODER_VERSION, laid out so it can be used straight from
+ * a read-only mapping:
+ *
+ *   DecodeCacheHeader
+ *   Instruction[instruction_count]
+ *   char[listing_size]               the disassembly text, one line each
+ *
+ * Entries are written to a private temporary file and renamed into place, so
+ * concurrent processes only ever see complete entries, and a reader's mapping
+ * survives another process evicting the file. Recency for LRU eviction is the
+ * file's modification time, refreshed on every hit.
+ */
+struct DecodeCache {
+  std::filesystem::path directory {};
+  u64 limit_bytes = 0;
+};
+
+
+constexpr u32 DECODE_CACHE_MAGIC = 0x44363849;  // "I86D"
+constexpr std::string_view DECODE_CACHE_EXTENSION = ".i86dc";
+
+
+struct DecodeCacheHeader {
+  u32 magic;
+  u32 decoder_version;
+  u64 image_hash;
+  u64 image_size;
+  u32 instruction_bytes;
+  u32 instruction_count;
+  u64 listing_size;
+};
+
+
+static_assert(std::is_trivially_copyable_v<Instruction>);
+static_assert(sizeof(DecodeCacheHeader) % alignof(Instruction) == 0);
+
+
+struct DecodeCacheEntry {
+  MappedFile file {};
+  const Instruction* instructions = nullptr;
+  u32 instruction_count = 0;
+  std::string_view listing {};
+};
+
+
+std::filesystem::path decode_cache_path(const DecodeCache& cache, u64 hash) {
+  return cache.directory / std::format("{:016x}-v{}{}", hash, DECODER_VERSION, DECODE_CACHE_EXTENSION);
+}
+
+
+bool open_decode_cache_entry(const DecodeCache& cache, const std::vector<u8>& image, DecodeCacheEntry& entry) {
+  u64 hash = hash_image(image);
+  std::filesystem::path path = decode_cache_path(cache, hash);
+  if (!map_file_read_only(path, entry.file)) {
+    return false;
+  }
+  DecodeCacheHeader header {};
+  bool valid = entry.file.size >= sizeof(header);
+  if (valid) {
+    std::memcpy(&header, entry.file.data, sizeof(header));
+    valid = header.magic == DECODE_CACHE_MAGIC
+      && header.decoder_version == DECODER_VERSION
+      && header.image_hash == hash
+      && header.image_size == image.size()
+      && header.instruction_bytes == sizeof(Instruction)
+      && entry.file.size == sizeof(header)
+        + SIZE(header.instruction_count) * sizeof(Instruction) + header.listing_size;
+  }
+  if (!valid) {
+    unmap_file(entry.file);
+    return false;
+  }
+  const u8* instructions = entry.file.data + sizeof(header);
+  entry.instructions = reinterpret_cast<const Instruction*>(instructions);
+  entry.instruction_count = header.instruction_count;
+  entry.listing = std::string_view(
+    reinterpret_cast<const char*>(instructions + SIZE(header.instruction_count) * sizeof(Instruction)),
+    header.listing_size
+  );
+  std::error_code error {};
+  std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), error);
+  return true;
+}
+
+
+void close_decode_cache_entry(DecodeCacheEntry& entry) {
+  unmap_file(entry.file);
+  entry = {};
+}
+
+
+/* Temporary files older than this belong to a process that died mid-write. */
+constexpr auto DECODE_CACHE_STALE_TEMPORARY = std::chrono::hours(1);
+
+
+/* Removes the least recently used entries until the cache fits its limit. */
+void evict_decode_cache(const DecodeCache& cache) {
+  struct CacheFile {
+    std::filesystem::path path;
+    u64 size;
+    std::filesystem::file_time_type used;
+  };
+  std::vector<CacheFile> files {};
+  u64 total = 0;
+  auto now = std::filesystem::file_time_type::clock::now();
+  std::error_code error {};
+  std::filesystem::directory_iterator it(cache.directory, error);
+  for (; !error && it != std::filesystem::directory_iterator(); it.increment(error)) {
+    const std::filesystem::directory_entry& item = *it;
+    std::error_code item_error {};
+    u64 size = item.file_size(item_error);
+    auto used = item.last_write_time(item_error);
+    if (item_error) {
+      continue;
+    }
+    if (item.path().extension() == ".tmp") {
+      if (now - used > DECODE_CACHE_STALE_TEMPORARY) {
+        std::filesystem::remove(item.path(), item_error);
+      }
+    } else if (item.path().extension() == DECODE_CACHE_EXTENSION) {
+      files.push_back({item.path(), size, used});
+      total += size;
+    }
+  }
+  if (total <= cache.limit_bytes) {
+    return;
+  }
+  std::sort(files.begin(), files.end(), [](const CacheFile& a, const CacheFile& b) {
+    return a.used < b.used;
+  });
+  for (const CacheFile& file : files) {
+    if (total <= cache.limit_bytes) {
+      break;
+    }
+    /* Another process may have evicted it already; either way it is gone. */
+    std::filesystem::remove(file.path, error);
+    total -= file.size;
+  }
+}
+
+
+u64 process_id() {
+#ifdef _WIN32
+  return GetCurrentProcessId();
+#else
+  return U64(getpid());
+#endif
+}
+
+
+void copy_operand(const Operand& from, Operand& to) {
+  to.kind = from.kind;
+  to.reg = from.reg;
+  to.rm = from.rm;
+  to.direct = from.direct;
+  to.displacement_bytes = from.displacement_bytes;
+  to.displacement = from.displacement;
+  to.immediate = from.immediate;
+}
+
+
+/*
+ * Lays the instructions out as cache records. Fields are copied one by one
+ * over zeroed memory, so the padding bytes are zero and the same image always
+ * produces the same entry.
+ */
+std::vector<u8> decode_cache_records(const std::vector<Instruction>& instructions) {
+  std::vector<u8> records(instructions.size() * sizeof(Instruction), 0);
+  for (size_t i = 0; i < instructions.size(); i++) {
+    Instruction record;
+    std::memset(static_cast<void*>(&record), 0, sizeof(record));
+    const Instruction& instruction = instructions[i];
+    record.operation = instruction.operation;
+    record.mnemonic = instruction.mnemonic;
+    record.wide = instruction.wide;
+    record.size = instruction.size;
+    record.address = instruction.address;
+    copy_operand(instruction.destination, record.destination);
+    copy_operand(instruction.source, record.source);
+    std::memcpy(&records[i * sizeof(Instruction)], static_cast<const void*>(&record), sizeof(record));
+  }
+  return records;
+}
+
+
+void store_decode_cache_entry(
+  const DecodeCache& cache, const std::vector<u8>& image,
+  const std::vector<Instruction>& instructions, const std::string& listing
+) {
+  /* An entry bigger than the whole cache would be evicted straight away. */
+  u64 entry_size = sizeof(DecodeCacheHeader) + instructions.size() * sizeof(Instruction) + listing.size();
+  if (entry_size > cache.limit_bytes) {
+    return;
+  }
+  u64 hash = hash_image(image);
+  std::filesystem::path path = decode_cache_path(cache, hash);
+  std::filesystem::path temporary = cache.directory / std::format(
+    "{:016x}.{}.{}.tmp", hash, process_id(),
+    std::chrono::steady_clock::now().time_since_epoch().count()
+  );
+  std::error_code error {};
+  std::filesystem::create_directories(cache.directory, error);
+
+  DecodeCacheHeader header {
+    DECODE_CACHE_MAGIC, DECODER_VERSION, hash, image.size(),
+    U32(sizeof(Instruction)), U32(instructions.size()), listing.size()
+  };
+  std::vector<u8> records = decode_cache_records(instructions);
+  {
+    std::ofstream file(temporary, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(records.data()), records.size());
+    file.write(listing.data(), listing.size());
+    file.close();
+    if (!file) {
+      std::cerr << std::format("{}: Could not write decode cache entry: {}\n", __LINE__, temporary.string());
+      std::filesystem::remove(temporary, error);
+      return;
+    }
+  }
+  std::filesystem::rename(temporary, path, error);
+  if (error) {
+    std::filesystem::remove(temporary, error);
+    return;
+  }
+  evict_decode_cache(cache);
+}
+
+
+/*
+ * State kept between rebuilds in --watch mode: the last image and the offset
+ * and disassembly of every instruction in it.
+ */
+struct WatchIndex {
+  std::vector<u8> image {};
+  std::vector<u32> offsets {};
+  std::vector<std::string> lines {};
+};
+
+
+/* Indexes an image, leaving the index empty if the image does not decode. */
+WatchIndex build_watch_index(std::vector<u8>& image) {
+  WatchIndex index {};
+  std::string text {};
+  std::string error {};
+  size_t cursor = 0;
+  while (cursor < image.size()) {
+    size_t size = try_disassemble_at(image, cursor, text, error);
+    if (!size) {
+      std::cerr << std::format("{}: {}; waiting for the next build\n", __LINE__, error);
+      return {};
+    }
+    index.offsets.push_back(U32(cursor));
+    index.lines.push_back(text);
+    cursor += size;
+  }
+  index.image = image;
+  return index;
+}
+
+
+/*
+ * Brings the index up to date with a new image and prints the replaced lines
+ * as a unified diff hunk. Decoding restarts at the last boundary at or before
+ * the first changed byte. It stops once the stream has passed the changed
+ * bytes and lands on an old boundary again, shifted by the change in length.
+ * Everything after that point decodes exactly as before. The cost of
+ * decoding is therefore proportional to the edit, not to the image. If the
+ * new image does not decode, the index is left as it was.
+ */
+void update_watch_index(WatchIndex& index, std::vector<u8>& image) {
+  std::vector<u8>& old_image = index.image;
+  size_t common = std::min(old_image.size(), image.size());
+  size_t prefix = SIZE(std::mismatch(
+    old_image.begin(), old_image.begin() + common, image.begin()
+  ).first - old_image.begin());
+  if (prefix == common && old_image.size() == image.size()) {
+    return;
+  }
+  size_t suffix = 0;
+  while (suffix < common - prefix
+      && old_image[old_image.size() - 1 - suffix] == image[image.size() - 1 - suffix]) {
+    suffix++;
+  }
+  i64 delta = i64(image.size()) - i64(old_image.size());
+
+  std::vector<u32>& offsets = index.offsets;
+  size_t first = SIZE(std::upper_bound(offsets.begin(), offsets.end(), prefix) - offsets.begin());
+  first = first ? first - 1 : 0;
+  size_t cursor = first < offsets.size() ? offsets[first] : 0;
+  /* When bytes were only appended the old end is itself a boundary, so
+   * decoding starts there and no old line is re-emitted. */
+  if (prefix == old_image.size()) {
+    first = offsets.size();
+    cursor = old_image.size();
+  }
+  size_t last = offsets.size();
+
+  std::vector<u32> new_offsets {};
+  std::vector<std::string> new_lines {};
+  std::string text {};
+  std::string error {};
+  while (cursor < image.size()) {
+    if (cursor >= image.size() - suffix) {
+      size_t old_offset = SIZE(i64(cursor) - delta);
+      auto resync = std::lower_bound(offsets.begin() + first, offsets.end(), old_offset);
+      if (resync != offsets.end() && *resync == old_offset) {
+        last = SIZE(resync - offsets.begin());
+        break;
+      }
+    }
+    size_t size = try_disassemble_at(image, cursor, text, error);
+    if (!size) {
+      std::cerr << std::format("{}: {}; keeping the previous listing\n", __LINE__, error);
+      return;
+    }
+    new_offsets.push_back(U32(cursor));
+    new_lines.push_back(text);
+    cursor += size;
+  }
+
+  /* An empty range starts at the line before it, as in unified diffs. */
+  size_t removed = last - first;
+  size_t added = new_lines.size();
+  std::string hunk = std::format(
+    "@@ -{},{} +{},{} @@\n",
+    removed ? first + 1 : first, removed, added ? first + 1 : first, added
+  );
+  for (size_t i = first; i < last; i++) {
+    hunk += "-" + index.lines[i];
+  }
+  for (const std::string& line : new_lines) {
+    hunk += "+" + line;
+  }
+  std::cout << hunk << std::flush;
+
+  offsets.erase(offsets.begin() + first, offsets.begin() + last);
+  offsets.insert(offsets.begin() + first, new_offsets.begin(), new_offsets.end());
+  for (size_t i = first + new_offsets.size(); i < offsets.size(); i++) {
+    offsets[i] = U32(i64(offsets[i]) + delta);
+  }
+  index.lines.erase(index.lines.begin() + first, index.lines.begin() + last);
+  index.lines.insert(
+    index.lines.begin() + first,
+    std::make_move_iterator(new_lines.begin()), std::make_move_iterator(new_lines.end())
+  );
+  old_image = std::move(image);
+}
+
+
+constexpr auto WATCH_POLL_INTERVAL = std::chrono::milliseconds(100);
+
+
+/*
+ * Prints the full listing, then polls the file and prints a hunk for every
+ * change. A change is only picked up once the file's size and modification
+ * time hold still for one poll, so half-written files are not decoded. A
+ * build that does not decode is reported and the previous listing is kept.
+ */
+void watch_program(const std::string& filename) {
+  std::vector<u8> image {};
+  read_binary_file(filename, image);
+  WatchIndex index = build_watch_index(image);
+  for (const std::string& line : index.lines) {
+    std::cout << line;
+  }
+  std::cout << std::flush;
+
+  std::error_code time_error {};
+  std::error_code size_error {};
+  auto seen_time = std::filesystem::last_write_time(filename, time_error);
+  auto seen_size = std::filesystem::file_size(filename, size_error);
+  bool pending = false;
+  while (true) {
+    std::this_thread::sleep_for(WATCH_POLL_INTERVAL);
+    auto time = std::filesystem::last_write_time(filename, time_error);
+    auto size = std::filesystem::file_size(filename, size_error);
+    if (time_error || size_error) {
+      continue;
+    }
+    if (time != seen_time || size != seen_size) {
+      seen_time = time;
+      seen_size = size;
+      pending = true;
+      continue;
+    }
+    if (!pending) {
+      continue;
+    }
+    pending = false;
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) {
+      continue;
+    }
+    image.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    update_watch_index(index, image);
+  }
+}
+
+
+struct Options {
+  std::string program_filename {};
+  std::string dump_filename {};
+  std::string image_filename {};
+  ImageRegion image {};
+  bool execute = false;
+  bool fuse = true;
+  bool stats = false;
+  bool bus_model = false;
+  CpuModel cpu_model = CpuModel::I8086;
+  std::string cache_directory {};
+  u64 cache_limit_mb = 256;
+  bool verify = false;
+  bool watch = false;
+};
+
+
+void print_usage(const char* argv0) {
+  std::cerr << std::format(
+    "Usage: {} --verify\n"
+    "       {} <program> --watch\n"
+    "       {} <program> [--exec [--no-fuse] [--stats]] [--bus-model 8086|8088]\n"
+    "          [--cache-dir DIR [--cache-limit MB]] [--dump FILE]\n"
+    "          [--image WxH@offset FILE]\n"
+    "  --exec                     Execute the program instead of disassembling\n"
+    "                             it, then print the final registers\n"
+    "  --no-fuse                  Do not fuse SUB/CMP+Jcc and loop tail pairs\n"
+    "  --stats                    Print instruction and dispatch counts\n"
+    "  --bus-model 8086|8088      Execute with a bus interface unit and prefetch\n"
+    "                             queue model; report per-instruction stalls\n"
+    "  --cache-dir DIR            Reuse decodes of identical images across runs\n"
+    "  --cache-limit MB           Evict least recently used entries past this\n"
+    "                             size (default 256)\n"
+    "  --dump FILE                Back guest memory with FILE; it holds the\n"
+    "                             full 1 MiB memory image on exit\n"
+    "  --image WxH@offset FILE    Write the RGBA framebuffer at offset to FILE\n"
+    "                             (PPM if FILE ends in .ppm, raw otherwise)\n"
+    "  --verify                   Round-trip every encoding through the encoder\n"
+    "                             and decoder, reporting mismatches per class\n"
+    "  --watch                    Keep running and print only the lines that\n"
+    "                             change each time the program file changes\n",
+    argv0, argv0, argv0
+  );
+}
+
+
+Options parse_options(int argc, char **argv) {
+  Options options {};
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    if (arg == "--verify") {
+      options.verify = true;
+    } else if (arg == "--watch") {
+      options.watch = true;
+    } else if (arg == "--exec") {
+      options.execute = true;
+    } else if (arg == "--no-fuse") {
+      options.fuse = false;
+    } else if (arg == "--stats") {
+      options.stats = true;
+    } else if (arg == "--bus-model" && i + 1 < argc) {
+      std::string_view model = argv[++i];
+      if (model == "8086") {
+        options.cpu_model = CpuModel::I8086;
+      } else if (model == "8088") {
+        options.cpu_model = CpuModel::I8088;
+      } else {
+        std::cerr << std::format("{}: Unknown bus model: {}\n", __LINE__, model);
+        std::exit(EXIT_FAILURE);
+      }
+      options.bus_model = true;
+      options.execute = true;
+    } else if (arg == "--cache-dir" && i + 1 < argc) {
+      options.cache_directory = argv[++i];
+    } else if (arg == "--cache-limit" && i + 1 < argc) {
+      u32 limit = 0;
+      if (!parse_u32(argv[++i], limit)) {
+        std::cerr << std::format("{}: Bad cache limit: {}\n", __LINE__, argv[i]);
+        std::exit(EXIT_FAILURE);
+      }
+      options.cache_limit_mb = limit;
+    } else if (arg == "--dump" && i + 1 < argc) {
+      options.dump_filename = argv[++i];
+    } else if (arg == "--image" && i + 2 < argc) {
+      if (!parse_image_region(argv[++i], options.image)) {
+        std::cerr << std::format("{}: Bad image specification: {}\n", __LINE__, argv[i]);
+        std::exit(EXIT_FAILURE);
+      }
+      options.image_filename = argv[++i];
+    } else if (arg.starts_with("--") || !options.program_filename.empty()) {
+      print_usage(argv[0]);
+      std::exit(EXIT_FAILURE);
+    } else {
+      options.program_filename = arg;
+    }
+  }
+  if (options.program_filename.empty() && !options.verify) {
+    std::cerr << std::format(
+      "{}: Must specify program file as first positional argument\n", __LINE__
+    );
+    print_usage(argv[0]);
+    std::exit(EXIT_FAILURE);
+  }
+  return options;
+}
+
+
+int main(int argc, char **argv) {
+  Options options = parse_options(argc, argv);
+  if (options.verify) {
+    return verify_decoder() ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  const std::string& program_filename = options.program_filename;
+  if (!std::filesystem::exists(program_filename)) {
+    std::cerr << std::format(
+    "{}: Could not find program file: {}\n", __LINE__, program_filename
+  );
+    return EXIT_FAILURE;
+  }
+
+  if (options.watch) {
+    watch_program(program_filename);
+    return EXIT_SUCCESS;
+  }
+
+  std::vector<u8> program_data {};
+  read_binary_file(program_filename, program_data);
+  if (options.execute && program_data.size() > MAX_EXECUTABLE_IMAGE_SIZE) {
+    std::cerr << std::format(
+      "{}: Program of {} bytes is too large to execute; code must fit in one {} byte segment\n",
+      __LINE__, program_data.size(), MAX_EXECUTABLE_IMAGE_SIZE
+    );
+    return EXIT_FAILURE;
+  }
+
+  GuestMemory memory {};
+  if (options.dump_filename.empty()) {
+    allocate_guest_memory(memory);
+  } else {
+    map_guest_memory(options.dump_filename, memory);
+  }
+  load_program(program_data, memory);
+
+  /* Look the image up in the decode cache; on a miss, decode it and fill in
+   * the entry for next time. */
+  bool use_cache = !options.cache_directory.empty();
+  DecodeCache cache {options.cache_directory, options.cache_limit_mb << 20};
+  DecodeCacheEntry cached {};
+  bool cache_hit = use_cache && open_decode_cache_entry(cache, program_data, cached);
+  std::vector<Instruction> instructions {};
+  std::string listing {};
+  if (cache_hit) {
+    if (options.execute) {
+      instructions.assign(cached.instructions, cached.instructions + cached.instruction_count);
+    }
+  } else {
+    if (options.execute || use_cache) {
+      instructions = decode_program(program_data);
+    }
+    if (use_cache) {
+      listing = disassemble_program(program_data);
+      store_decode_cache_entry(cache, program_data, instructions, listing);
+    }
+  }
+
+  if (options.execute) {
+    /* The bus model times every instruction on its own, so it runs unfused. */
+    bool fuse = options.fuse && !options.bus_model;
+    Program program = predecode(std::move(instructions), program_data.size(), fuse);
+    Cpu cpu {};
+    ExecutionStats stats {};
+    if (options.bus_model) {
+      BusModel bus = make_bus_model(options.cpu_model, program.instructions.size());
+      run_bus_model(cpu, memory, program, stats, bus);
+      print_bus_model(bus, program, program_data);
+    } else {
+      run(cpu, memory, program, stats);
+    }
+    print_registers(cpu);
+    if (options.stats) {
+      print_stats(stats);
+    }
+  } else if (use_cache) {
+    std::string_view output = cache_hit ? cached.listing : listing;
+    std::cout.write(output.data(), output.size());
+  } else {
+    print_disassembly(program_data);
+  }
+  close_decode_cache_entry(cached);
 
-    std::cout << disassemble(name, operation, instruction);
+  if (!options.image_filename.empty()) {
+    write_image(options.image_filename, options.image, memory);
   }
+  release_guest_memory(memory);
   
   std::exit(EXIT_SUCCESS);
 }